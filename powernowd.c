@@ -62,6 +62,20 @@
 #include <errno.h>
 #include <signal.h>
 #include <time.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <strings.h>
+#include <linux/netlink.h>
+#include <pthread.h>
 
 #define pprintf(level, ...) do { \
 	if (level <= verbosity) { \
@@ -72,6 +86,22 @@
 	} \
 } while(0)
 
+enum modes {
+	LOWER,
+	SAME,
+	RAISE
+};
+
+enum function {
+	SINE,
+	AGGRESSIVE,
+	PASSIVE,
+	LEAPS,
+	TARGET
+};
+#define NFUNCS (TARGET+1)
+
+/* one cpu's line of /proc/stat, in column order (see enum stat_column) */
 typedef struct cpustats {
 	unsigned long long user;
 	unsigned long long mynice;
@@ -80,24 +110,87 @@ typedef struct cpustats {
 	unsigned long long iowait;
 	unsigned long long irq;
 	unsigned long long softirq;
+	unsigned long long steal;
+	unsigned long long guest;
+	unsigned long long guest_nice;
 } cpustats_t;
 
+/*
+ * Load history (-e/-w).  Each cpu keeps its last HIST_LEN loads and how
+ * many msecs each one covered, and decisions are made on the smoothed
+ * load instead of just the last poll's.  Rising load is smoothed over
+ * rise_ms and falling load over decay_ms, so a short rise_ms still ramps
+ * up quickly while a long decay_ms stops one quiet poll dropping speed.
+ */
+#define HIST_LEN 64
+typedef struct history {
+	float pct[HIST_LEN];
+	unsigned int ms[HIST_LEN];
+	int head; /* next slot to write */
+	int count;
+	float ewma;
+} history_t;
+
 typedef struct cpuinfo {
+	/*
+	 * Hot: looked at for every cpu on every poll.  The /proc/stat
+	 * counters themselves are in stat_now/stat_last, by cpuid.
+	 */
 	unsigned int cpuid;
+	int scalable_unit; /* cpuid of the cpu leading our unit, -1 if none */
+	int offline; /* not in the online mask */
+	unsigned int current_speed;
+	history_t *hist; /* only with -e/-w */
+	/* hot, but only used in the lead cpu of a unit */
+	int nsiblings; /* cpus in the unit, including this one */
+	int unit_offline; /* all the unit's cpus are offline */
+	int *siblings;
+	enum modes change; /* this poll's decision, for the whole unit */
+	float pct; /* busiest cpu's load this poll, -1 if none */
+	int busiest; /* that cpu */
+	float last_pct;
+	float io_boost; /* least load to assume, for -i */
+	/* the unit's settings, from the command line or the control socket */
+	enum function func;
+	unsigned int highwater;
+	unsigned int lowwater;
+	float vote_lo; /* lowwater and highwater as vote_for() wants them */
+	float vote_hi;
+	int paused; /* leave its speed alone */
+	unsigned int speed_index;
+	/* 
+	 * freq_table[top_index..bottom_index] is what we may use right now,
+	 * inside scaling_max/min_freq and -U/-L.
+	 */
+	unsigned int top_index;
+	unsigned int bottom_index;
+	int target_index; /* TARGET mode: the freq_table entry load needs */
+	int table_size;
+	const unsigned long *freq_table; /* shared, see intern_table() */
+	unsigned int last_written; /* what's in scaling_setspeed, 0 = unknown */
+	int setspeed_fd;
+	unsigned int residency_ms; /* least time to stay at a speed */
+	float budget; /* transitions we may still make right now (-b) */
+	unsigned long long changed_ms; /* when the speed last changed */
+	unsigned long long budget_ms; /* when budget was last topped up */
+	unsigned int trace_last; /* -D's last record for us, see trace_key() */
+	/* cold: setup, and the checks every LIMIT_POLLS polls */
 	unsigned int nspeeds;
 	unsigned int max_speed;
 	unsigned int min_speed;
-	unsigned int current_speed;
-	unsigned int speed_index;
-	int fd;
-	char *sysfs_dir;
-	cpustats_t *last_reading;
-	cpustats_t *reading;
+	unsigned int step; /* freq_table was built with, 0 = the driver's */
 	int in_mhz; /* 0 = speed in kHz, 1 = speed in mHz */
-	unsigned long *freq_table;
-	int table_size;
-	int threads_per_core;
-	int scalable_unit;
+	int needs_init; /* was offline at startup, get_per_cpu_info() pending */
+	int minfreq_fd; /* scaling_min_freq, kept open to re-read */
+	int maxfreq_fd; /* scaling_max_freq */
+	int curfreq_fd; /* scaling_cur_freq */
+	/* -k: the policy's own limits, and the band we last wrote */
+	unsigned long orig_min;
+	unsigned long orig_max;
+	unsigned long band_min;
+	unsigned long band_max;
+	char *sysfs_dir;
+	struct unit_metrics *metrics; /* NULL without -O or -C */
 } cpuinfo_t;
 
 /* 
@@ -105,34 +198,113 @@ typedef struct cpuinfo {
  */
 
 cpuinfo_t **all_cpus;
+int ncpus = 0;
+
+/*
+ * The /proc/stat counters, struct-of-arrays: stat_now[column][cpu] is from
+ * the latest snapshot and stat_last[column][cpu] from the one before.
+ * parse_stat() swaps the two sets and fills in stat_now.  Guest time is
+ * already counted in user (and guest_nice in nice), steal isn't counted
+ * anywhere else.  Kernels older than 2.6.33 don't have all of them.
+ */
+enum stat_column {
+	ST_USER,
+	ST_NICE,
+	ST_SYSTEM,
+	ST_IDLE,
+	ST_IOWAIT,
+	ST_IRQ,
+	ST_SOFTIRQ,
+	ST_STEAL,
+	ST_GUEST,
+	ST_GUEST_NICE,
+	NSTAT
+};
+unsigned long long *stat_now[NSTAT];
+unsigned long long *stat_last[NSTAT];
+/* with -P, a wakeup's snapshot goes here so the polls' pair isn't moved */
+unsigned long long *stat_scratch[NSTAT];
+
+/*
+ * Everything per cpu (the cpuinfo_ts, the counters above, the sibling
+ * lists and load histories) is carved out of one arena, allocated once
+ * by alloc_cpus(), so a poll walks a few contiguous arrays instead of
+ * chasing pointers around the heap.
+ */
+static void *arena = NULL;
+static int *sibling_pool = NULL;
+static int siblings_used = 0;
+
+/*
+ * The lead cpu of every scalable unit (cpufreq policy), in cpu order.
+ */
+cpuinfo_t **units;
+int nunits = 0;
 
 /* idea stolen from procps */
-static char buf[2048];
+static char buf[8192];
 
-enum function {
-	SINE,
-	AGGRESSIVE,
-	PASSIVE,
-	LEAPS
-} func = AGGRESSIVE; 
+/*
+ * /proc/stat is much bigger than buf on machines with lots of cpus, so it
+ * gets its own buffer which grows to fit.  It is read once per poll.
+ */
+static char *statbuf = NULL;
+static size_t statbuf_size = 0;
+static size_t statbuf_len = 0;
+int stat_fd = -1;
 
-enum modes {
-	LOWER,
-	SAME,
-	RAISE
-};
+enum function func = AGGRESSIVE; 
 
 /* for a daemon as simple as this, global data is ok. */
 /* settings */
 int daemonize = 1;
 int ignore_nice = 1;
+/* what time stolen by the hypervisor counts as (-t) */
+enum steal_modes {
+	STEAL_EXCLUDE,
+	STEAL_IDLE,
+	STEAL_BUSY
+} steal_mode = STEAL_EXCLUDE;
+/* iowait boost (-i): iowait % of a poll that counts as waiting on i/o */
+unsigned int iowait_boost = 0;
 int verbosity = 0;
 unsigned int step = 100000;  /* in kHz */
 unsigned int poll = 1000; /* in msecs */
 unsigned int highwater = 80;
 unsigned int lowwater = 20;
+/* adaptive polling (-a): poll moves between poll_min and poll_max */
+int adaptive = 0;
+unsigned int poll_min = 0;
+unsigned int poll_max = 0;
+/* load smoothing (-e/-w) */
+enum smoothing {
+	SMOOTH_NONE,
+	SMOOTH_EWMA,
+	SMOOTH_WINDOW
+} smoothing = SMOOTH_NONE;
+unsigned int rise_ms = 0;
+unsigned int decay_ms = 0;
+long clk_tck = 100;
+/* rate limiting: -M min residency in msecs, -b transitions per second */
+unsigned int min_residency = 0;
+float max_rate = 0;
+unsigned long long now_ms = 0; /* when this poll's decisions were made */
+unsigned long long now_ns = 0; /* the same, for the decision trace */
+unsigned int suppressed_count = 0;
+unsigned int drift_count = 0; /* times scaling_cur_freq surprised us */
+/*
+ * Governor coexistence (-k #): leave the kernel's governor alone and steer
+ * it by writing scaling_min_freq/scaling_max_freq, # table entries either
+ * side of the speed we'd have picked, instead of using scaling_setspeed.
+ */
+int coexist = 0;
+unsigned int band = 1;
+/* -U/-L, in kHz, 0 = none */
 unsigned int max_limit = 0;
 unsigned int min_limit = 0;
+/* re-read scaling_min/max/cur_freq every LIMIT_POLLS polls */
+#define LIMIT_POLLS 10
+unsigned int limit_polls = 0;
 unsigned int step_specified = 0;
 unsigned int t_per_core = 1;
 unsigned int cores_specified = 0;
@@ -140,9 +312,195 @@ unsigned int cores_specified = 0;
 /* statistics */
 unsigned int change_speed_count = 0;
 time_t start_time = 0;
+/* i/o done on the hot path, for benchmarking (-B) */
+unsigned long long io_syscalls = 0;
+unsigned long long io_bytes_read = 0;
+unsigned int bench_ticks = 0;
+
+/*
+ * Metrics (-O, and the control socket's "metrics" command), in
+ * Prometheus's text format.  Each unit counts the time it spent at each
+ * freq_table entry, its transitions (from, to) and a histogram of its
+ * load; the daemon keeps a histogram of how long its polls take.  They're
+ * allocated when a unit is set up and the poll only adds to them, so it
+ * never allocates or locks, and the file is rewritten (to a temporary
+ * file, renamed over it) every METRICS_SECS from the main loop.
+ */
+#define METRICS_SECS 10
+/* no from x to matrix for tables bigger than this, just up and down */
+#define TRANS_STATES 64
+#define LOAD_BUCKETS 10 /* le 0.1, 0.2, .. 1.0 */
+#define TICK_BUCKETS 10
+
+typedef struct unit_metrics {
+	unsigned int states; /* table_size, when these were allocated */
+	unsigned int index; /* the speed_index counted last */
+	unsigned long long since_ms; /* counted up to, 0 = not yet */
+	unsigned long long up, down;
+	unsigned long long load[LOAD_BUCKETS + 1]; /* not cumulative */
+	double load_sum;
+	unsigned long long *time_ms; /* by freq_table index */
+	unsigned int *trans; /* [from * states + to], NULL if too big */
+} unit_metrics_t;
+
+char *metrics_path = NULL;
+static const double tick_le[TICK_BUCKETS] = {
+	0.00001, 0.000025, 0.00005, 0.0001, 0.00025,
+	0.0005, 0.001, 0.0025, 0.005, 0.01
+};
+unsigned long long tick_hist[TICK_BUCKETS + 1];
+double tick_sum = 0;
+int alloc_metrics(cpuinfo_t *cpu);
+int save_metrics(void);
+int setup_metrics(void);
+int write_metrics(FILE *f);
+
+/*
+ * Decision trace (-D file).  Each decision to change a unit's speed and
+ * what it was made from go in a 32 byte record, in a ring of TRACE_RECORDS
+ * of them mmap'd from file, so recording one is never a syscall or a
+ * message, and polls that change nothing record nothing.  The oldest
+ * records are overwritten; -X turns what's left into CSV.  The header's
+ * head counts every record ever written and the next one goes in slot
+ * head % records.  The layout is fixed width and in the recording
+ * machine's byte order.
+ */
+#define TRACE_MAGIC "PNDTRACE"
+#define TRACE_VERSION 1
+#define TRACE_RECORDS 65536 /* 2MB, a power of two */
+
+/* the record's change is enum modes, or'd with these */
+#define TR_CHANGE 3
+#define TR_HELD 4 /* the change was held back by -M/-b */
+#define TR_PAUSED 8 /* by the control socket */
+#define TR_PRESSURE 16 /* decided on a -P wakeup, not a poll */
+
+/* the /proc/stat deltas kept, guest time is in user already */
+enum trace_column {
+	TD_USER,
+	TD_NICE,
+	TD_SYSTEM, /* and irq and softirq */
+	TD_IDLE,
+	TD_IOWAIT,
+	TD_STEAL,
+	TRACE_COLS
+};
+
+typedef struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t records; /* slots in the ring */
+	uint64_t head; /* records written, ever */
+	uint32_t clk_tck; /* the deltas are in these */
+	uint32_t pad[7];
+} trace_header_t;
+
+typedef struct trace_record {
+	uint64_t ns; /* CLOCK_MONOTONIC */
+	uint16_t unit; /* the cpu leading it */
+	uint16_t cpu; /* its busiest cpu, the deltas are that cpu's */
+	uint16_t pct; /* the load decided on, in 1/10000ths, or TR_NO_PCT */
+	uint16_t old_mhz;
+	uint16_t new_mhz;
+	uint8_t change;
+	uint8_t func;
+	uint16_t delta[TRACE_COLS]; /* jiffies, at most 65535 */
+} trace_record_t;
+#define TR_NO_PCT 0xffff
+
+char *trace_path = NULL;
+char *decode_path = NULL;
+trace_header_t *trace_ring = NULL;
+trace_record_t *trace_recs;
+int setup_trace(void);
+int decode_trace(void);
+/* trace driven simulation (-S), nothing is written to sysfs */
+char *sim_trace = NULL;
+int simulate = 0;
+int mode_specified = 0;
+
+/*
+ * The main loop waits on an epoll set of event sources, each an fd with a
+ * handler to call when it's readable.  For now that's the poll timer and
+ * the signals we exit on; anything else that should wake the daemon up
+ * gets added the same way.  Nothing sleeps anywhere else.
+ */
+typedef struct event_source {
+	int fd;
+	void (*handler)(struct event_source *src);
+} event_source_t;
+
+int epoll_fd = -1;
+event_source_t timer_src = { -1, NULL };
+event_source_t signal_src = { -1, NULL };
+event_source_t psi_src = { -1, NULL };
+event_source_t hotplug_src = { -1, NULL };
+event_source_t metrics_src = { -1, NULL };
+
+/* the control socket (-C), and the clients connected to it */
+#define CTL_CLIENTS 4
+#define CTL_LINE 256
+#define CTL_ARGS 16
+#define CTL_REPLY (1 << 20) /* the most one command may send back */
+
+typedef struct ctl_client {
+	event_source_t src; /* first, the handler is given a pointer to it */
+	int len;
+	int skip; /* rest of a line that was too long */
+	char buf[CTL_LINE];
+} ctl_client_t;
+
+char *ctl_path = NULL;
+event_source_t ctl_src = { -1, NULL };
+static ctl_client_t ctl_clients[CTL_CLIENTS];
+/* the reply being put together, sent in one go once it's complete */
+static char *ctl_reply = NULL;
+static size_t ctl_reply_len;
+static int ctl_reply_full;
+int setup_control(void);
+
+/*
+ * Cpu hotplug.  Which cpus are online comes from sysfs's online mask,
+ * re-read whenever the kernel sends a cpu uevent (under -r, whenever
+ * anything is written to the fake tree's uevent fifo), and every
+ * LIMIT_POLLS polls in case we missed one.
+ */
+int hotplug_fifo = 0;
+char *now_online = NULL;
+int *online_list = NULL;
+unsigned int hotplug_count = 0;
+int update_online(void);
+int setup_hotplug(void);
+
+/* 
+ * cpu pressure trigger (-P), e.g. "some 50000 1000000": the kernel wakes
+ * us up when tasks stall waiting for a cpu, so we can ramp up between
+ * polls.  Under -r the pressure file may be a fifo standing in for it.
+ */
+char *psi_trigger = NULL;
+int psi_fifo = 0;
+unsigned int psi_wakeups = 0;
+
+/* absolute CLOCK_MONOTONIC time of the next poll */
+struct timespec next_tick;
 
 #define SYSFS_TREE "/sys/devices/system/cpu/"
 #define SYSFS_SETSPEED "scaling_setspeed"
+#define PROC_STAT "/proc/stat"
+#define PROC_PRESSURE "/proc/pressure/cpu"
+
+/*
+ * Everything we touch lives under root_dir, which is normally "/" but can
+ * be pointed at a fake tree (see make_fake_tree()) with -r.
+ */
+#define ROOT_MAX (PATH_MAX/2)
+char *root_dir = NULL;
+char sysfs_tree[ROOT_MAX] = SYSFS_TREE;
+char proc_stat[ROOT_MAX] = PROC_STAT;
+char proc_pressure[ROOT_MAX] = PROC_PRESSURE;
+unsigned int fake_cpus = 0;
+unsigned int fake_unit = 1;	/* 1000 for a fake tree in MHz, as -G #m */
 
 #define VERSION	"1.00"
 
@@ -161,19 +519,56 @@ void help(void)
 	printf("	-v	Increase output verbosity, can be used more than once.\n");
 	printf("	-q	Quiet mode, only emergency output.\n");
 	printf("	-n	Include 'nice'd processes in calculations\n");
-	printf("	-m #	Modes of operation, can be 0, 1, 2, or 3:\n");
+	printf("	-m #	Modes of operation, can be 0, 1, 2, 3 or 4:\n");
 	printf("		0 = SINE, 1 = AGGRESSIVE (default),\n");
-	printf("		2 = PASSIVE, 3 = LEAPS\n");
+	printf("		2 = PASSIVE, 3 = LEAPS, 4 = TARGET\n");
 	printf("	-s #	Frequency step in kHz (default = 100000)\n");
 	printf("	-p #	Polling frequency in msecs (default = 1000)\n");
-	printf("	-c #	Specify number of threads per power-managed core\n");
+	printf("	-a #:#	Adaptive polling between min:max msecs, fast while\n");
+	printf("		load moves or nears -u/-l, backing off while steady\n");
+	printf("	-e #:#	Decide on load smoothed as an EWMA, with rise:decay\n");
+	printf("		time constants in msecs\n");
+	printf("	-w #:#	Decide on the busier of the mean load over the last\n");
+	printf("		rise and over the last decay msecs (-w rise:decay)\n");
+	printf("	-t str	Count steal time as exclude (default), idle or busy\n");
+	printf("	-i #	Boost units that spend # %% of a poll in iowait\n");
+	printf("	-k #	Keep the kernel's governor and just bound it, # steps\n");
+	printf("		either side of our speed, via scaling_min/max_freq\n");
+	printf("	-U #	Never go faster than # kHz\n");
+	printf("	-L #	Never go slower than # kHz\n");
+	printf("	-M #	Stay at least # msecs at a speed before changing it\n");
+	printf("	-b #	Change a unit's speed at most # times a second\n");
+	printf("	-P str	Raise busy units as soon as the cpu pressure trigger\n");
+	printf("		str fires, e.g. \"some 50000 1000000\" (see PSI)\n");
+	printf("	-C path	Take commands on the unix socket path (see README)\n");
+	printf("	-O file	Keep Prometheus metrics in file, rewritten every %ds\n",
+			METRICS_SECS);
+	printf("	-D file	Record speed change decisions in a ring buffer in file\n");
+	printf("	-X file	Write the -D decision trace in file out as CSV\n");
+	printf("	-c #	Force # cpus (numbered together) per scalable unit,\n");
+	printf("		instead of using the cpufreq policies\n");
 	printf("	-u #	CPU usage upper limit percentage [0 .. 100, default 80]\n");
 	printf("	-l #    CPU usage lower limit percentage [0 .. 100, default 20]\n");
+	printf("	-r dir	Use dir as the root for /sys and /proc (for testing)\n");
+	printf("	-G #	Build a fake cpufreq tree with # cpus under -r dir\n");
+	printf("		(use -c to group them into scalable units, #m for MHz),\n");
+	printf("		then exit\n");
+	printf("	-B #	Benchmark # polls back to back on the -r fake tree\n");
+	printf("	-S file	Simulate the /proc/stat trace in file for each mode\n");
+	printf("		(or just -m), never touching sysfs, and exit\n");
+	printf("	-T file	Search -m/-u/-l/-p/-s on the trace in file for the\n");
+	printf("		best energy vs. under-provisioning (at -u), and exit\n");
+	printf("	-R #	With -T, try # random settings instead of a grid\n");
 
 	printf("\n");
 	return;
 }
 
+static inline unsigned long long ts_ns(struct timespec *ts)
+{
+	return (ts->tv_sec * 1000000000ULL) + ts->tv_nsec;
+}
+
 /* 
  * Open a file and copy it's first 1024 bytes into the global "buf".
  * Zero terminate the buffer. 
@@ -206,550 +601,4302 @@ int read_file(const char *file, int fd, int new)
 }
 
 /*
- * Reads /proc/stat into buf, and parses the output.
- *
- * Format of line:
- * ...
- * cpu<id> <user> <nice> <system> <idle> <iowait> <irq> <softirq>
+ * Reads all of /proc/stat into statbuf with the long lived stat_fd, growing
+ * the buffer if it doesn't fit.  seq_file (and a plain file) only hands back
+ * a short read at EOF, so a short read means we're done.
  */
-int get_stat(cpuinfo_t *cpu)
+int read_stat(void)
 {
-	char *p1, *p2, searchfor[10];
+	ssize_t n;
+	size_t len = 0;
+	char *tmp;
 	int err;
-	
-	if ((err = read_file("/proc/stat", cpu->fd, 0)) != 0) {
-		return err;
-	}
-
-	sprintf(searchfor, "cpu%d ", cpu->cpuid);
 
-	p1 = strstr(buf, searchfor);
-	if (p1 == NULL) {
-		perror("Error parsing /proc/stat");
-		return ENOENT;
+	if (statbuf == NULL) {
+		statbuf_size = 4096;
+		if ((statbuf = (char *)malloc(statbuf_size)) == NULL) {
+			perror("Couldn't allocate /proc/stat buffer");
+			return ENOMEM;
+		}
 	}
-	
-	p2 = p1+strlen(searchfor);
 
-	memcpy(cpu->last_reading, cpu->reading, sizeof(cpustats_t));
-	
-	cpu->reading->user = strtoll(p2, &p2, 10);
-	cpu->reading->mynice = strtoll(p2, &p2, 10);
-	cpu->reading->system = strtoll(p2, &p2, 10);
-	cpu->reading->idle = strtoll(p2, &p2, 10);
-	cpu->reading->iowait = strtoll(p2, &p2, 10);
-	cpu->reading->irq = strtoll(p2, &p2, 10);
-	cpu->reading->softirq = strtoll(p2, &p2, 10);
+	while (1) {
+		if (len == (statbuf_size - 1)) {
+			tmp = (char *)realloc(statbuf, statbuf_size*2);
+			if (tmp == NULL) {
+				perror("Couldn't grow /proc/stat buffer");
+				return ENOMEM;
+			}
+			statbuf = tmp;
+			statbuf_size *= 2;
+		}
+		n = pread(stat_fd, statbuf + len, statbuf_size - 1 - len, len);
+		io_syscalls++;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			err = errno;
+			perror(proc_stat);
+			return err;
+		}
+		len += n;
+		io_bytes_read += n;
+		if (n == 0 || len < (statbuf_size - 1))
+			break;
+	}
+	statbuf[len] = '\0';
+	statbuf_len = len;
 
 	return 0;
 }
 
 /*
- * Once a decision is made, change the speed.
+ * The numbers in /proc/stat are plain unsigned decimals separated by
+ * spaces, so this is all of strtoull we need, without the locale, errno,
+ * sign and base handling.  Skips spaces, takes digits up to whatever
+ * isn't one and leaves *pp there.  No digits is 0.
  */
-
-int change_speed(cpuinfo_t *cpu, enum modes mode)
+static inline unsigned long long scan_number(char **pp)
 {
-	int fd, len, err, i;
-	cpuinfo_t *save;
-	char writestr[100];
-
-	if (cpu->cpuid != cpu->scalable_unit) 
-		return 0;
-	
-	if (mode == RAISE) {
-		if ((func == AGGRESSIVE) || (func == LEAPS)) {
-			cpu->speed_index = 0;
-		} else {
-			if (cpu->speed_index != 0) cpu->speed_index--;
-		} 
-	} else {
-		if ((func == PASSIVE) || (func == LEAPS)) {
-			cpu->speed_index = (cpu->table_size-1);
-		} else {
-			if (cpu->speed_index != (cpu->table_size-1))
-				cpu->speed_index++;
-		}
-	}
+	const unsigned char *p = (const unsigned char *)*pp;
+	unsigned long long v = 0;
+	unsigned int d;
 
-	/* 
-	 * We need to set the current speed on all virtual CPUs that fall
-	 * into this CPU's scalable unit.
-	 */
-	save = cpu;
-	for (i = save->cpuid; i < (save->cpuid + save->threads_per_core); i++) {
-		cpu = all_cpus[i];
-		cpu->current_speed = save->freq_table[save->speed_index];
+	while (*p == ' ')
+		p++;
+	while ((d = *p - '0') < 10) {
+		v = (v * 10) + d;
+		p++;
 	}
-	cpu = save;
+	*pp = (char *)p;
+	return v;
+}
 
-	pprintf(3,"Setting speed to %d\n", cpu->current_speed);
+/*
+ * Parses the text of one /proc/stat snapshot, from p up to end, filling in
+ * the readings of every cpu in one pass.
+ *
+ * Format of line:
+ * ...
+ * cpu<id> <user> <nice> <system> <idle> <iowait> <irq> <softirq> <steal>
+ *	<guest> <guest_nice>
+ *
+ * The aggregate "cpu " line comes first and the per-cpu lines follow it in
+ * a block, so stop at the first line that isn't a cpu line (or isn't
+ * complete).  Offline cpus don't show up at all, so their counters
+ * aren't kept up to date (decide_speed() leaves them out).  Columns an
+ * older kernel doesn't have read as 0.
+ *
+ * A counter that goes backwards has either wrapped or is iowait, which
+ * can step back a little on nohz kernels.  Either way there's no telling
+ * how much time went by, so the last reading is pulled back to match and
+ * that column counts nothing this time.
+ */
+int parse_stat(char *p, char *end)
+{
+	unsigned long long *tmp, v;
+	unsigned int id;
+	int col, found = 0;
+	char *eol;
 
-	change_speed_count++;
-	
-	strncpy(writestr, cpu->sysfs_dir, 50);
-	strncat(writestr, SYSFS_SETSPEED, 20);
-	
-	if ((fd = open(writestr, O_WRONLY)) < 0) {
-		err = errno;
-		perror("Can't open scaling_setspeed");
-		return err;
+	/* the latest snapshot becomes the last one */
+	for (col = 0; col < NSTAT; col++) {
+		tmp = stat_last[col];
+		stat_last[col] = stat_now[col];
+		stat_now[col] = tmp;
 	}
 
-	lseek(fd, 0, SEEK_CUR);
-	
-	sprintf(writestr, "%d\n", (cpu->in_mhz) ?
-			(cpu->current_speed / 1000) : cpu->current_speed); 
+	while ((p = memchr(p, '\n', end - p)) != NULL) {
+		p++;
+		if (((end - p) < 3) || (memcmp(p, "cpu", 3) != 0))
+			break;
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+			break;
+		p += 3;
+		/* not a per-cpu line, probably the aggregate "cpu " line */
+		if ((*p < '0') || (*p > '9')) {
+			p = eol;
+			continue;
+		}
+		id = scan_number(&p);
+		if (id >= ncpus) {
+			p = eol;
+			continue;
+		}
 
-	pprintf(4,"mode=%d, str=%s", mode, writestr);
-	
-	if ((len = write(fd, writestr, strlen(writestr))) < 0) {
-		err = errno;
-		perror("Couldn't write to scaling_setspeed\n");
-		return err;
+		/* scan_number() never goes past the newline */
+		for (col = 0; col < NSTAT; col++) {
+			v = scan_number(&p);
+			if (v < stat_last[col][id])
+				stat_last[col][id] = v;
+			stat_now[col][id] = v;
+		}
+		p = eol;
+		found++;
 	}
 
-	if (len != strlen(writestr)) {
-		printf("Could not write scaling_setspeed\n");
-		close(fd);
-		return EPIPE;
+	if (found == 0) {
+		pprintf(0, "Error parsing /proc/stat: no cpu lines\n");
+		return ENOENT;
 	}
-	close(fd);
 
 	return 0;
 }
 
 /*
- * The heart of the program... decide to raise or lower the speed.
+ * Reads /proc/stat once and parses it.
  */
-enum modes inline decide_speed(cpuinfo_t *cpu)
+int get_stat(void)
 {
 	int err;
-	float pct;
-	unsigned long long usage, total;
-	
-	if ((err = get_stat(cpu)) < 0) {
-		perror("Can't get stats");
+
+	if ((err = read_stat()) != 0) {
 		return err;
 	}
 
-	total = (cpu->reading->user - cpu->last_reading->user) +
-		(cpu->reading->system - cpu->last_reading->system) +
-		(cpu->reading->mynice - cpu->last_reading->mynice) +
-		(cpu->reading->idle - cpu->last_reading->idle) +
-		(cpu->reading->iowait - cpu->last_reading->iowait) +
-		(cpu->reading->irq - cpu->last_reading->irq) +
-		(cpu->reading->softirq - cpu->last_reading->softirq);
+	return parse_stat(statbuf, statbuf + statbuf_len);
+}
 
-	if (ignore_nice) { 
-		usage = (cpu->reading->user - cpu->last_reading->user) +
-			(cpu->reading->system - cpu->last_reading->system) +
-			(cpu->reading->irq - cpu->last_reading->irq) +
-			(cpu->reading->softirq - cpu->last_reading->softirq);
-	} else {
-		usage = (cpu->reading->user - cpu->last_reading->user) +
-			(cpu->reading->mynice - cpu->last_reading->mynice) +
-			(cpu->reading->system - cpu->last_reading->system) +
-			(cpu->reading->irq - cpu->last_reading->irq) +
-			(cpu->reading->softirq - cpu->last_reading->softirq);
+/*
+ * Open the scaling_setspeed file of a cpu.  It's kept open for the life of
+ * the daemon and only reopened if a write to it fails.
+ */
+int open_setspeed(cpuinfo_t *cpu)
+{
+	char filename[PATH_MAX];
+	int err;
+
+	snprintf(filename, sizeof(filename), "%s%s", cpu->sysfs_dir,
+			SYSFS_SETSPEED);
+
+	io_syscalls++;
+	if ((cpu->setspeed_fd = open(filename, O_WRONLY)) < 0) {
+		err = errno;
+		perror("Can't open scaling_setspeed");
+		return err;
 	}
-	
-	pct = ((float)usage)/((float)total);
-	
-	pprintf(4,"PCT = %f\n", pct);
-	
-	if ((pct >= ((float)highwater/100.0)) && 
-			(cpu->current_speed != cpu->max_speed)) {
-		/* raise speed to next level */
-		pprintf(6, "got here RAISE\n"); 
-		return RAISE;
-	} else if ((pct <= ((float)lowwater/100.0)) && 
-			(cpu->current_speed != cpu->min_speed)) {
-		/* lower speed */
-		pprintf(6, "got here LOWER\n"); 
-		return LOWER;
+	return 0;
+}
+
+/*
+ * Write one frequency to a kept open sysfs file.
+ */
+static int write_freq(int fd, unsigned long freq)
+{
+	char writestr[24];
+	int len, err;
+
+	len = sprintf(writestr, "%lu\n", freq);
+	io_syscalls++;
+	if (pwrite(fd, writestr, len, 0) != len) {
+		err = errno ? errno : EPIPE;
+		perror("Couldn't write to scaling_min/max_freq");
+		return err;
 	}
-	
-	return SAME;
+	return 0;
 }
 
-/* 
- * Abuse glibc's qsort.  Compare function to sort list of frequencies in 
- * ascending order.
+/*
+ * -k: box the kernel governor in to band entries either side of
+ * current_speed.  The order matters, the kernel won't take a min above
+ * the max, so when moving up the max goes first and when moving down the
+ * min does.
  */
-int faked_compare(const void *a, const void *b)
+int write_band(cpuinfo_t *cpu)
 {
-	unsigned long *a1 = (unsigned long *)a;
-	unsigned long *b1 = (unsigned long *)b;
+	unsigned long lo, hi;
+	int err, i;
 
-	if (*a1 < *b1) return 1;
-	if (*a1 > *b1) return -1;
+	i = cpu->speed_index - band;
+	hi = cpu->freq_table[(i < (int)cpu->top_index) ? cpu->top_index : i];
+	i = cpu->speed_index + band;
+	lo = cpu->freq_table[(i > (int)cpu->bottom_index) ? 
+		cpu->bottom_index : i];
 
+	pprintf(4, "band=%lu-%lu\n", lo, hi);
+	if (hi > cpu->band_max) {
+		if ((err = write_freq(cpu->maxfreq_fd, hi)) ||
+				(err = write_freq(cpu->minfreq_fd, lo)))
+			return err;
+	} else {
+		if ((err = write_freq(cpu->minfreq_fd, lo)) ||
+				(err = write_freq(cpu->maxfreq_fd, hi)))
+			return err;
+	}
+	cpu->band_min = lo;
+	cpu->band_max = hi;
 	return 0;
 }
 
 /*
- * Allocates and initialises the per-cpu data structures.
+ * Write current_speed out to scaling_setspeed, unless that is what we wrote
+ * last time.  If the write fails (say, the cpu was unplugged under us) the
+ * fd is thrown away and we try once more with a fresh one.
  */
-int get_per_cpu_info(cpuinfo_t *cpu, int cpuid)
+int write_speed(cpuinfo_t *cpu)
 {
-	char cpustr[100], scratch[100], tmp[11], *p1;
-	int fd, err;
-	unsigned long temp;
-	
-	cpu->cpuid = cpuid;
-	cpu->sysfs_dir = (char *)malloc(50*sizeof(char));
-	if (cpu->sysfs_dir == NULL) {
-		perror("Couldn't allocate per-cpu sysfs_dir");
-		return ENOMEM;
-	}
-	memset(cpu->sysfs_dir, 0, (50*sizeof(char)));
+	int len, err, tries;
+	char writestr[20];
 
-	strncpy(cpu->sysfs_dir, SYSFS_TREE, 30);
-	sprintf(cpustr, "cpu%d/cpufreq/", cpuid);
-	strncat(cpu->sysfs_dir, cpustr, 20);
-	
-	strncpy(scratch, cpu->sysfs_dir, 50);
-	strncat(scratch, "cpuinfo_max_freq", 18);
-	if ((err = read_file(scratch, 0, 1)) != 0) {
-		return err;
+	if (cpu->current_speed == cpu->last_written)
+		return 0;
+
+	if (simulate) {
+		cpu->last_written = cpu->current_speed;
+		change_speed_count++;
+		return 0;
 	}
-	
-	cpu->max_speed = strtol(buf, NULL, 10);
-	
-	strncpy(scratch, cpu->sysfs_dir, 50);
-	strncat(scratch, "cpuinfo_min_freq", 18);
 
-	if ((err = read_file(scratch, 0, 1)) != 0) {
-		return err;
+	if (coexist) {
+		if ((err = write_band(cpu)) != 0) {
+			cpu->last_written = 0;
+			return err;
+		}
+		cpu->last_written = cpu->current_speed;
+		change_speed_count++;
+		return 0;
 	}
 
-	cpu->min_speed = strtol(buf, NULL, 10);
+	/* current_speed comes from the table, so it's in the driver's units */
+	sprintf(writestr, "%d\n", cpu->current_speed); 
 
-	/* 
-	 * More error handling, make sure step is not larger than the 
-	 * difference between max and min speeds. If so, truncate it.
-	 */
-	if (step > (cpu->max_speed - cpu->min_speed)) {
-		step = cpu->max_speed - cpu->min_speed;
+	pprintf(4,"str=%s", writestr);
+
+	for (tries = 0; tries < 2; tries++) {
+		if ((cpu->setspeed_fd < 0) && 
+				((err = open_setspeed(cpu)) != 0))
+			return err;
+
+		len = pwrite(cpu->setspeed_fd, writestr, strlen(writestr), 0);
+		io_syscalls++;
+		if (len == strlen(writestr)) {
+			cpu->last_written = cpu->current_speed;
+			change_speed_count++;
+			return 0;
+		}
+
+		err = (len < 0) ? errno : EPIPE;
+		perror("Couldn't write to scaling_setspeed");
+		close(cpu->setspeed_fd);
+		io_syscalls++;
+		cpu->setspeed_fd = -1;
 	}
-	
-	/* XXXjc read the real current speed */
-	cpu->current_speed = cpu->max_speed;
-	cpu->speed_index = 0;
 
-	strncpy(scratch, cpu->sysfs_dir, 50);
-	strncat(scratch, "scaling_available_frequencies", 50);
+	/* make sure we try again next time around */
+	cpu->last_written = 0;
+	return err;
+}
 
-	if (((err = read_file(scratch, 0, 1)) != 0) || (step_specified)) {
-		/* 
-		 * We don't have scaling_available_frequencies. build the
-		 * table from the min, max, and step values.  the driver
-		 * could ignore these, but we'll represent it this way since
-		 * we don't have any other info.
-		 */
-		cpu->table_size = ((cpu->max_speed-cpu->min_speed)/step) + 1;
-		cpu->table_size += ((cpu->max_speed-cpu->min_speed)%step)?1:0;
-		
-		cpu->freq_table = (unsigned long *)
-			malloc(cpu->table_size*sizeof(unsigned long));
+/*
+ * Once a decision is made, change the speed.
+ */
 
-		if (cpu->freq_table == (unsigned long *)NULL) {
-			perror("couldn't allocate cpu->freq_table");
-			return ENOMEM;
-		}
+int set_speed_index(cpuinfo_t *cpu);
 
-		/* populate the table.  Start at the top, and subtract step */
-		for (temp = 0; temp < cpu->table_size; temp++) {
-			cpu->freq_table[temp] = 
-			((cpu->min_speed<(cpu->max_speed-(temp*step))) ? 
-			 (cpu->max_speed-(temp*step)) :
-			 (cpu->min_speed) );
-		}	
+int change_speed(cpuinfo_t *cpu, enum modes mode)
+{
+	if (cpu->cpuid != cpu->scalable_unit) 
+		return 0;
+	
+	if (cpu->func == TARGET) {
+		cpu->speed_index = cpu->target_index;
+	} else if (mode == RAISE) {
+		if ((cpu->func == AGGRESSIVE) || (cpu->func == LEAPS)) {
+			cpu->speed_index = cpu->top_index;
+		} else {
+			if (cpu->speed_index > cpu->top_index) 
+				cpu->speed_index--;
+		} 
 	} else {
+		if ((cpu->func == PASSIVE) || (cpu->func == LEAPS)) {
+			cpu->speed_index = cpu->bottom_index;
+		} else {
+			if (cpu->speed_index < cpu->bottom_index)
+				cpu->speed_index++;
+		}
+	}
+
+	return set_speed_index(cpu);
+}
+
+/*
+ * Make the unit's speed freq_table[speed_index], pulled inside the
+ * current limits first.
+ */
+int set_speed_index(cpuinfo_t *cpu)
+{
+	int i;
+
+	if (cpu->speed_index < cpu->top_index)
+		cpu->speed_index = cpu->top_index;
+	if (cpu->speed_index > cpu->bottom_index)
+		cpu->speed_index = cpu->bottom_index;
+
+	/* 
+	 * We need to set the current speed on all virtual CPUs that fall
+	 * into this CPU's scalable unit.
+	 */
+	for (i = 0; i < cpu->nsiblings; i++) {
+		all_cpus[cpu->siblings[i]]->current_speed = 
+			cpu->freq_table[cpu->speed_index];
+	}
+
+	pprintf(3,"Setting speed to %d\n", cpu->current_speed);
+
+	return write_speed(cpu);
+}
+
+/*
+ * Work out which part of freq_table the unit may use, given its policy's
+ * scaling_max_freq and scaling_min_freq (ceiling and floor, 0 if we don't
+ * know them) and -U/-L.  If nothing in the table fits, the entry nearest
+ * the ceiling is all we get.
+ */
+void clip_table(cpuinfo_t *cpu, unsigned long ceiling, unsigned long floor)
+{
+	unsigned long scale = cpu->in_mhz ? 1000 : 1;
+	unsigned int i;
+
+	if (max_limit && ((ceiling == 0) || (max_limit / scale < ceiling)))
+		ceiling = max_limit / scale;
+	if (min_limit / scale > floor)
+		floor = min_limit / scale;
+
+	for (i = 0; (i < cpu->table_size - 1) && ceiling && 
+			(cpu->freq_table[i] > ceiling); i++);
+	cpu->top_index = i;
+	for (i = cpu->table_size - 1; (i > cpu->top_index) && 
+			(cpu->freq_table[i] < floor); i--);
+	cpu->bottom_index = i;
+}
+
+/*
+ * Read a frequency from a kept open sysfs file, 0 if we can't.
+ */
+static unsigned long read_freq(int fd)
+{
+	char val[24];
+	ssize_t len;
+
+	if (fd < 0)
+		return 0;
+	len = pread(fd, val, sizeof(val) - 1, 0);
+	io_syscalls++;
+	if (len <= 0)
+		return 0;
+	io_bytes_read += len;
+	val[len] = '\0';
+	return strtoul(val, NULL, 10);
+}
+
+/*
+ * Re-read the unit's scaling_max_freq and scaling_min_freq, which thermal
+ * daemons and power cappers move about, and if they've changed clip the
+ * table and pull the speed back inside them straight away.
+ */
+int check_limits(cpuinfo_t *cpu)
+{
+	unsigned int top = cpu->top_index, bottom = cpu->bottom_index;
+
+	/* with -k they're ours, nobody else's limits are visible */
+	if (coexist)
+		return 0;
+
+	clip_table(cpu, read_freq(cpu->maxfreq_fd), 
+			read_freq(cpu->minfreq_fd));
+	if ((top == cpu->top_index) && (bottom == cpu->bottom_index))
+		return 0;
+
+	pprintf(2, "unit %d: using %lu - %lu now\n", cpu->cpuid, 
+			cpu->freq_table[cpu->bottom_index], 
+			cpu->freq_table[cpu->top_index]);
+	if ((cpu->speed_index >= cpu->top_index) && 
+			(cpu->speed_index <= cpu->bottom_index))
+		return 0;
+	return set_speed_index(cpu);
+}
+
+/*
+ * Index of the freq_table entry nearest freq.
+ */
+static unsigned int nearest_index(cpuinfo_t *cpu, unsigned long freq)
+{
+	unsigned int i;
+
+	for (i = 0; (i < cpu->table_size) && (cpu->freq_table[i] > freq); i++);
+	if (i == cpu->table_size)
+		return i - 1;
+	if ((i > 0) && (cpu->freq_table[i-1] - freq < freq - cpu->freq_table[i]))
+		return i - 1;
+	return i;
+}
+
+/*
+ * Compare the speed the unit is really running at (scaling_cur_freq) with
+ * the one we think it's at.  Firmware throttling, or somebody else writing
+ * scaling_setspeed, can move it under us.  If so, say so, count it, and
+ * carry on deciding from where it really is, or if that's outside the
+ * limits we're keeping to, put it back inside them.  Under -k the
+ * governor moves it about within our band by design, so there's nothing
+ * to check.
+ *
+ * On x86 scaling_cur_freq is an APERF/MPERF average that wanders about
+ * and seldom lands on a table entry, so a reading one entry either side
+ * of ours counts as where we put it.
+ */
+int check_speed(cpuinfo_t *cpu)
+{
+	unsigned long freq;
+	unsigned int index;
+	int i;
+
+	if (coexist || ((freq = read_freq(cpu->curfreq_fd)) == 0))
+		return 0;
+	index = nearest_index(cpu, freq);
+	if ((index + 1 >= cpu->speed_index) && (index <= cpu->speed_index + 1))
+		return 0;
+
+	drift_count++;
+	pprintf(1, "unit %d: running at %lu, not %lu, resyncing\n", 
+			cpu->cpuid, freq, cpu->freq_table[cpu->speed_index]);
+	cpu->speed_index = index;
+	for (i = 0; i < cpu->nsiblings; i++) {
+		all_cpus[cpu->siblings[i]]->current_speed = 
+			cpu->freq_table[index];
+	}
+	cpu->last_written = cpu->current_speed;
+	/* check_limits() only acts when the limits move, so do it here */
+	if ((index < cpu->top_index) || (index > cpu->bottom_index))
+		return set_speed_index(cpu);
+	return 0;
+}
+
+/*
+ * The load kernel works on every cpu at once and leaves its results here,
+ * by cpuid: the fraction of the time since the last snapshot each cpu was
+ * busy (-1 if no time went by), how many jiffies went by, and what that
+ * load alone would have the cpu's unit do, LOWER, SAME or RAISE (NO_VOTE
+ * if there was nothing to go on).  A unit's decision is the max of its
+ * cpus' votes, which is the vote of its busiest cpu.
+ */
+#define NO_VOTE (-1)
+float *loads;
+unsigned long long *load_jiffies;
+signed char *votes;
+int scalar_kernel = 0; /* don't use the vector kernel (for -B) */
+
+/*
+ * The kernel one cpu at a time, for cpus from..to-1.  This is the whole
+ * thing on compilers without vector extensions, and does whatever is left
+ * over after the last full vector otherwise.
+ */
+static void load_scalar(int from, int to)
+{
+	unsigned long long *now[NSTAT], *last[NSTAT];
+	unsigned long long usage, total, nice_mask, steal_total, steal_busy;
+	int i;
+
+	memcpy(now, stat_now, sizeof(now));
+	memcpy(last, stat_last, sizeof(last));
+	nice_mask = ignore_nice ? 0 : ~0ULL;
+	steal_total = (steal_mode != STEAL_EXCLUDE) ? ~0ULL : 0;
+	steal_busy = (steal_mode == STEAL_BUSY) ? ~0ULL : 0;
+	for (i = from; i < to; i++) {
+#define DELTA(col) (now[col][i] - last[col][i])
+		total = DELTA(ST_USER) + DELTA(ST_NICE) + DELTA(ST_SYSTEM) +
+			DELTA(ST_IDLE) + DELTA(ST_IOWAIT) + DELTA(ST_IRQ) +
+			DELTA(ST_SOFTIRQ) + (DELTA(ST_STEAL) & steal_total);
+		usage = DELTA(ST_USER) + (DELTA(ST_NICE) & nice_mask) +
+			DELTA(ST_SYSTEM) + DELTA(ST_IRQ) + DELTA(ST_SOFTIRQ) +
+			(DELTA(ST_STEAL) & steal_busy);
+#undef DELTA
+		load_jiffies[i] = total;
+		loads[i] = total ? ((float)usage / (float)total) : -1.0;
+	}
+}
+
+/*
+ * The vote for a load of pct.  lo and hi are the float thresholds from
+ * vote_kernel().  The sum counts how many of "has a load", "isn't low"
+ * and "is high" hold, and a high load is never low, even with lowwater
+ * at highwater.
+ */
+static inline int vote_for(float pct, float lo, float hi)
+{
+	return NO_VOTE + (pct >= 0) + ((pct > lo) || (pct >= hi)) + 
+		(pct >= hi);
+}
+
+/*
+ * Votes for cpus from..to-1.
+ */
+static void vote_scalar(int from, int to, float lo, float hi)
+{
+	int i;
+
+	for (i = from; i < to; i++)
+		votes[i] = vote_for(loads[i], lo, hi);
+}
+
+#if defined(__GNUC__) && (__GNUC__ >= 9 || defined(__clang__)) && \
+	!defined(NO_VECTOR)
+/*
+ * The same, VLEN cpus at a time, with gcc's vector extensions (SSE2 on
+ * x86-64, wider if you build with -march=native).  They return how many
+ * cpus they did, always a multiple of VLEN.
+ */
+#define HAVE_VECTOR
+#define VLEN 4
+typedef unsigned long long v4du __attribute__((vector_size(32)));
+typedef int v4si __attribute__((vector_size(16)));
+typedef float v4sf __attribute__((vector_size(16)));
+typedef signed char v4qi __attribute__((vector_size(4)));
+/* for loading a v4du from anywhere in a counter column */
+typedef unsigned long long v4du_u 
+	__attribute__((vector_size(32), aligned(8), may_alias));
+
+static int load_vector(int n)
+{
+	unsigned long long *now[NSTAT], *last[NSTAT];
+	v4du usage, total, big, nice_mask, steal_total, steal_busy;
+	v4si usage32, total32, none;
+	v4sf pct;
+	int i;
+
+	memcpy(now, stat_now, sizeof(now));
+	memcpy(last, stat_last, sizeof(last));
+	nice_mask = (v4du){ 0, 0, 0, 0 } + (ignore_nice ? 0 : ~0ULL);
+	steal_total = (v4du){ 0, 0, 0, 0 } + 
+		((steal_mode != STEAL_EXCLUDE) ? ~0ULL : 0);
+	steal_busy = (v4du){ 0, 0, 0, 0 } + 
+		((steal_mode == STEAL_BUSY) ? ~0ULL : 0);
+	for (i = 0; i + VLEN <= n; i += VLEN) {
+#define DELTA(col) (*(v4du_u *)&now[col][i] - *(v4du_u *)&last[col][i])
+		total = DELTA(ST_USER) + DELTA(ST_NICE) + DELTA(ST_SYSTEM) +
+			DELTA(ST_IDLE) + DELTA(ST_IOWAIT) + DELTA(ST_IRQ) +
+			DELTA(ST_SOFTIRQ) + (DELTA(ST_STEAL) & steal_total);
+		usage = DELTA(ST_USER) + (DELTA(ST_NICE) & nice_mask) +
+			DELTA(ST_SYSTEM) + DELTA(ST_IRQ) + DELTA(ST_SOFTIRQ) +
+			(DELTA(ST_STEAL) & steal_busy);
+#undef DELTA
+		memcpy(&load_jiffies[i], &total, sizeof(total));
+
 		/* 
-		 * We do have the file, parse it and build the table from
-		 * there.
-		 */ 
-		/* The format of scaling_available_frequencies (SAF) is:
-		 * "number<space>number2<space>...numberN<space>\n", but this
-		 * can change. So we're relying on the fact that strtoul will 
-		 * return 0 if it can't find anything, and that 0 will never 
-		 * be a real value for the available frequency. 
+		 * A poll's worth of jiffies fits in an int many times over,
+		 * and ints convert to float in one instruction.  The first
+		 * poll sees everything since boot though, so may not fit.
 		 */
-		p1 = buf;
-		
-		temp = strtoul(p1, &p1, 10);
-		while((temp > 0) && (cpu->table_size < 100)) {
-			cpu->table_size++;
-			temp = strtoul(p1, &p1, 10);
+		big = total >> 31;
+		if (big[0] | big[1] | big[2] | big[3]) {
+			load_scalar(i, i + VLEN);
+			continue;
+		}
+		total32 = __builtin_convertvector(total, v4si);
+		usage32 = __builtin_convertvector(usage, v4si);
+		none = (total32 == 0);
+		/* none is -1 where total is 0, so that divides by 1 */
+		pct = __builtin_convertvector(usage32, v4sf) / 
+			__builtin_convertvector(total32 - none, v4sf);
+		pct = (v4sf)(((v4si)pct & ~none) | 
+				((v4si)((v4sf){ -1, -1, -1, -1 }) & none));
+		memcpy(&loads[i], &pct, sizeof(pct));
+	}
+	return i;
+}
+
+static int vote_vector(int n, float lo, float hi)
+{
+	v4sf pct;
+	v4si vote;
+	v4qi v;
+	int i;
+
+	for (i = 0; i + VLEN <= n; i += VLEN) {
+		memcpy(&pct, &loads[i], sizeof(pct));
+		/* comparisons are -1 where true */
+		vote = NO_VOTE - (pct >= 0) - ((pct > lo) | (pct >= hi)) - 
+			(pct >= hi);
+		v = __builtin_convertvector(vote, v4qi);
+		memcpy(&votes[i], &v, sizeof(v));
+	}
+	return i;
+}
+#endif
+
+/*
+ * Every cpu's load from the current snapshot, unsmoothed.
+ */
+void load_kernel(void)
+{
+	int done = 0;
+
+#ifdef HAVE_VECTOR
+	if (!scalar_kernel)
+		done = load_vector(ncpus);
+#endif
+	load_scalar(done, ncpus);
+}
+
+/*
+ * decide_speed() always compared loads with highwater/100.0 and
+ * lowwater/100.0 as doubles.  The votes are done in float, so round the
+ * thresholds the right way: a float load is >= hi exactly when it's >=
+ * the smallest float >= hi, and likewise for lo.  Both are in [0, 1].
+ */
+static float float_at_least(double x)
+{
+	union { float f; uint32_t u; } v;
+
+	v.f = x;
+	if (v.f < x)
+		v.u++;
+	return v.f;
+}
+
+static float float_at_most(double x)
+{
+	union { float f; uint32_t u; } v;
+
+	v.f = x;
+	if (v.f > x)
+		v.u--;
+	return v.f;
+}
+
+/*
+ * Every cpu's vote, from loads[].
+ */
+void vote_kernel(void)
+{
+	float hi = float_at_least((double)highwater/100.0);
+	float lo = float_at_most((double)lowwater/100.0);
+	int done = 0;
+
+#ifdef HAVE_VECTOR
+	if (!scalar_kernel)
+		done = vote_vector(ncpus, lo, hi);
+#endif
+	vote_scalar(done, ncpus, lo, hi);
+}
+
+/*
+ * A unit's vote thresholds, after its highwater or lowwater is set.
+ */
+void set_thresholds(cpuinfo_t *cpu)
+{
+	cpu->vote_hi = float_at_least((double)cpu->highwater/100.0);
+	cpu->vote_lo = float_at_most((double)cpu->lowwater/100.0);
+}
+
+/*
+ * Start a unit off with the command line's settings.  The control socket
+ * (-C) can change them later, unit by unit.
+ */
+void unit_settings(cpuinfo_t *cpu)
+{
+	cpu->func = func;
+	cpu->highwater = highwater;
+	cpu->lowwater = lowwater;
+	cpu->paused = 0;
+	set_thresholds(cpu);
+}
+
+/*
+ * Time weighted mean of the newest loads in h covering at least span
+ * msecs (always at least the newest one).
+ */
+static inline float window_mean(history_t *h, unsigned int span)
+{
+	unsigned int ms = 0;
+	float sum = 0;
+	int i, slot;
+
+	for (i = 0; (i < h->count) && ((i == 0) || (ms < span)); i++) {
+		slot = (h->head + HIST_LEN - 1 - i) % HIST_LEN;
+		sum += h->pct[slot] * h->ms[slot];
+		ms += h->ms[slot];
+	}
+	return ms ? (sum / ms) : -1.0;
+}
+
+/*
+ * Only HIST_LEN polls are remembered, so -w windows longer than that many
+ * polls of p msecs would quietly be cut short.  Those are refused instead.
+ */
+static inline int window_fits(unsigned int p)
+{
+	unsigned int span = (rise_ms > decay_ms) ? rise_ms : decay_ms;
+
+	return (smoothing != SMOOTH_WINDOW) || (span <= HIST_LEN * p);
+}
+
+/*
+ * Smooth a cpu's load from the kernel with its history, as asked (-e/-w).
+ * With -w the load is the bigger of the means over the last rise_ms and
+ * the last decay_ms.  With -e it's an EWMA with a time constant of rise_ms
+ * when load goes up and decay_ms when it goes down (weighting a sample of
+ * ms msecs by ms/(ms+tau), which is close enough to 1-e^(-ms/tau) and
+ * doesn't need libm).
+ */
+static inline float smooth_load(cpuinfo_t *cpu)
+{
+	history_t *h = cpu->hist;
+	unsigned int ms, tau;
+	float pct, rise, decay;
+
+	pct = loads[cpu->cpuid];
+	if (pct < 0)
+		return pct;
+
+	ms = (load_jiffies[cpu->cpuid] * 1000) / clk_tck;
+	h->pct[h->head] = pct;
+	h->ms[h->head] = ms;
+	h->head = (h->head + 1) % HIST_LEN;
+	if (h->count < HIST_LEN)
+		h->count++;
+
+	if (smoothing == SMOOTH_WINDOW) {
+		rise = window_mean(h, rise_ms);
+		decay = window_mean(h, decay_ms);
+		return (rise > decay) ? rise : decay;
+	}
+
+	if (h->count == 1) {
+		h->ewma = pct;
+	} else {
+		tau = (pct > h->ewma) ? rise_ms : decay_ms;
+		if (ms + tau > 0)
+			h->ewma += (pct - h->ewma) * ms / (ms + tau);
+	}
+	return h->ewma;
+}
+
+/*
+ * Run the kernel on the current snapshot: every cpu's load, smoothed if
+ * asked to, and its vote.  Offline cpus get stale numbers, which nothing
+ * looks at.
+ */
+void load_all(void)
+{
+	cpuinfo_t *cpu;
+	int i;
+
+	load_kernel();
+	if (smoothing != SMOOTH_NONE) {
+		for (i = 0; i < ncpus; i++) {
+			cpu = all_cpus[i];
+			if (!cpu->offline && (cpu->scalable_unit >= 0))
+				loads[i] = smooth_load(cpu);
+		}
+	}
+	vote_kernel();
+}
+
+#define ARENA_ALIGN 64
+#define ARENA_ROUND(x) (((x) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/*
+ * Set up n cpus, with all their state in the arena: the cpuinfo_ts, both
+ * sets of counter columns, the pool the units' sibling lists come from,
+ * the load kernel's results, with -e/-w the load histories and with -P a
+ * third set of counter columns.  Each piece starts on a cache line.
+ */
+int alloc_cpus(int n)
+{
+	size_t cpus_size, col_size, sib_size, kern_size, hist_size, total;
+	size_t scratch_size;
+	cpuinfo_t *cpus, *cpu;
+	history_t *hist;
+	char *p;
+	int i, col;
+
+	cpus_size = ARENA_ROUND(n * sizeof(cpuinfo_t));
+	col_size = ARENA_ROUND(n * sizeof(unsigned long long));
+	sib_size = ARENA_ROUND(n * sizeof(int));
+	kern_size = ARENA_ROUND(n * sizeof(float)) + 
+		ARENA_ROUND(n * sizeof(unsigned long long)) +
+		ARENA_ROUND(n * sizeof(signed char));
+	hist_size = (smoothing == SMOOTH_NONE) ? 0 : 
+		ARENA_ROUND(n * sizeof(history_t));
+	scratch_size = psi_trigger ? (NSTAT * col_size) : 0;
+	total = cpus_size + (2 * NSTAT * col_size) + sib_size + kern_size +
+		hist_size + scratch_size;
+
+	all_cpus = (cpuinfo_t **)malloc(n * sizeof(cpuinfo_t *));
+	units = (cpuinfo_t **)malloc(n * sizeof(cpuinfo_t *));
+	if ((all_cpus == NULL) || (units == NULL) || 
+			(posix_memalign(&arena, ARENA_ALIGN, total) != 0)) {
+		perror("Couldn't allocate per-cpu state");
+		return ENOMEM;
+	}
+	memset(arena, 0, total);
+
+	p = (char *)arena;
+	cpus = (cpuinfo_t *)p;
+	p += cpus_size;
+	for (col = 0; col < NSTAT; col++) {
+		stat_now[col] = (unsigned long long *)p;
+		p += col_size;
+		stat_last[col] = (unsigned long long *)p;
+		p += col_size;
+	}
+	sibling_pool = (int *)p;
+	siblings_used = 0;
+	p += sib_size;
+	loads = (float *)p;
+	p += ARENA_ROUND(n * sizeof(float));
+	load_jiffies = (unsigned long long *)p;
+	p += ARENA_ROUND(n * sizeof(unsigned long long));
+	votes = (signed char *)p;
+	p += ARENA_ROUND(n * sizeof(signed char));
+	hist = hist_size ? (history_t *)p : NULL;
+	p += hist_size;
+	for (col = 0; col < NSTAT; col++) {
+		stat_scratch[col] = scratch_size ? (unsigned long long *)p : NULL;
+		p += scratch_size ? col_size : 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		cpu = all_cpus[i] = &cpus[i];
+		cpu->cpuid = i;
+		cpu->scalable_unit = -1;
+		cpu->setspeed_fd = -1;
+		cpu->minfreq_fd = -1;
+		cpu->maxfreq_fd = -1;
+		cpu->curfreq_fd = -1;
+		cpu->hist = hist ? &hist[i] : NULL;
+	}
+	ncpus = n;
+	nunits = 0;
+	pprintf(2, "%d cpus in %lu bytes, %lu per cpu\n", n, 
+			(unsigned long)total, (unsigned long)(total / n));
+	return 0;
+}
+
+/*
+ * TARGET mode.  pct was measured at current_speed, so the work actually
+ * done is pct * current_speed / max_speed of what the cpu could do flat
+ * out.  Pick the slowest speed that would run that at or below highwater
+ * and go straight there.  A cpu that's pegged may need more than that,
+ * but it will ask again next poll.
+ */
+static inline enum modes decide_target(cpuinfo_t *cpu, float pct)
+{
+	float need;
+	int i;
+
+	need = pct * cpu->freq_table[cpu->speed_index] * 100.0 / 
+		cpu->highwater;
+	for (i = cpu->bottom_index; i > cpu->top_index; i--) {
+		if (cpu->freq_table[i] >= need)
+			break;
+	}
+	cpu->target_index = i;
+
+	if (i < cpu->speed_index)
+		return RAISE;
+	if (i > cpu->speed_index)
+		return LOWER;
+	return SAME;
+}
+
+/*
+ * iowait boost (-i), after schedutil's.  A unit whose cpus keep waiting
+ * on i/o is taken to be at least io_boost busy.  That starts at
+ * IOWAIT_BOOST_MIN the first poll any of them spends iowait_boost% of its
+ * time in iowait, doubles every poll that keeps it up, to 1 (flat out),
+ * and halves every poll that doesn't until it drops below the minimum.
+ * So a burst of i/o does nothing, a unit stuck behind i/o for a few
+ * polls is pushed up, and it comes back down gradually.
+ */
+#define IOWAIT_BOOST_MIN 0.125
+
+static inline float update_io_boost(cpuinfo_t *cpu, int waiting)
+{
+	if (waiting) {
+		cpu->io_boost = (cpu->io_boost > 0) ? (cpu->io_boost * 2) : 
+			IOWAIT_BOOST_MIN;
+		if (cpu->io_boost > 1)
+			cpu->io_boost = 1;
+	} else if (cpu->io_boost > 0) {
+		cpu->io_boost /= 2;
+		if (cpu->io_boost < IOWAIT_BOOST_MIN)
+			cpu->io_boost = 0;
+	}
+	return cpu->io_boost;
+}
+
+/*
+ * The heart of the program... decide to raise or lower the speed of the
+ * unit that cpu leads.  The busiest cpu in the unit decides.  Works off
+ * what load_all() made of the last get_stat() snapshot.
+ */
+static inline enum modes decide_speed(cpuinfo_t *cpu)
+{
+	float pct;
+	int i, id, vote, waiting = 0;
+
+	pct = -1.0;
+	vote = NO_VOTE;
+	cpu->busiest = cpu->cpuid;
+	for (i = 0; i < cpu->nsiblings; i++) {
+		id = cpu->siblings[i];
+		/* an offline cpu's readings are stale, leave it out */
+		if (all_cpus[id]->offline)
+			continue;
+		if (loads[id] > pct) {
+			pct = loads[id];
+			cpu->busiest = id;
+		}
+		if (votes[id] > vote)
+			vote = votes[id];
+		if (iowait_boost && load_jiffies[id] &&
+				((stat_now[ST_IOWAIT][id] - 
+				  stat_last[ST_IOWAIT][id]) * 100 >= 
+				 load_jiffies[id] * iowait_boost))
+			waiting = 1;
+	}
+	/* the kernel votes on the command line's thresholds */
+	if ((cpu->highwater != highwater) || (cpu->lowwater != lowwater))
+		vote = vote_for(pct, cpu->vote_lo, cpu->vote_hi);
+	if (iowait_boost && (pct >= 0) && 
+			(update_io_boost(cpu, waiting) > pct)) {
+		pprintf(4, "unit %d: iowait boost %.3f\n", cpu->cpuid, 
+				cpu->io_boost);
+		pct = cpu->io_boost;
+		vote = vote_for(pct, cpu->vote_lo, cpu->vote_hi);
+	}
+	cpu->last_pct = cpu->pct;
+	cpu->pct = pct;
+
+	/* nothing ran since the last snapshot (or the cpu is offline) */
+	if (pct < 0)
+		return SAME;
+	
+	pprintf(4,"PCT = %f\n", pct);
+
+	if (cpu->func == TARGET)
+		return decide_target(cpu, pct);
+	
+	if ((vote == RAISE) && (cpu->speed_index > cpu->top_index)) {
+		/* raise speed to next level */
+		pprintf(6, "got here RAISE\n"); 
+		return RAISE;
+	} else if ((vote == LOWER) && 
+			(cpu->speed_index < cpu->bottom_index)) {
+		/* lower speed */
+		pprintf(6, "got here LOWER\n"); 
+		return LOWER;
+	}
+	
+	return SAME;
+}
+
+/* 
+ * Abuse glibc's qsort.  Compare function to sort list of frequencies in 
+ * ascending order.
+ */
+int faked_compare(const void *a, const void *b)
+{
+	unsigned long *a1 = (unsigned long *)a;
+	unsigned long *b1 = (unsigned long *)b;
+
+	if (*a1 < *b1) return 1;
+	if (*a1 > *b1) return -1;
+
+	return 0;
+}
+
+/* a jiffies delta as the trace keeps it, 655s at 100Hz before it sticks */
+static inline uint16_t trace_delta(unsigned long long d)
+{
+	return (d > 0xffff) ? 0xffff : d;
+}
+
+/*
+ * What a record says in a word: the change byte and the speed it left
+ * the unit at, with bit 7 set so that 0 can mean "nothing yet".
+ */
+static inline unsigned int trace_key(cpuinfo_t *cpu, int change)
+{
+	return (cpu->speed_index << 8) | 0x80 | change;
+}
+
+/*
+ * Put what the unit just decided, and did, in the decision trace.  Only
+ * decisions to change speed get here, held back or not, along with those
+ * a paused unit ignores and -P raises.  One that says just what the
+ * unit's last record did (held or paused again, at the same speed) is
+ * left out until a poll that decides SAME on some load clears trace_last,
+ * so a steady box writes next to nothing.
+ */
+static inline void trace_unit(cpuinfo_t *cpu, enum modes change, 
+		unsigned int old_index, int flags)
+{
+	uint64_t n;
+	trace_record_t *r;
+	const unsigned long *table = cpu->freq_table;
+	int id = cpu->busiest;
+	unsigned int key;
+
+	flags |= change | (cpu->paused ? TR_PAUSED : 0);
+	if ((key = trace_key(cpu, flags)) == cpu->trace_last)
+		return;
+	cpu->trace_last = key;
+	n = trace_ring->head;
+	r = &trace_recs[n & (TRACE_RECORDS - 1)];
+
+	r->ns = now_ns;
+	r->unit = cpu->cpuid;
+	r->cpu = id;
+	r->pct = (cpu->pct < 0) ? TR_NO_PCT : (uint16_t)(cpu->pct * 10000);
+	r->old_mhz = cpu->in_mhz ? table[old_index] : 
+		table[old_index] / 1000;
+	r->new_mhz = cpu->in_mhz ? table[cpu->speed_index] : 
+		table[cpu->speed_index] / 1000;
+	r->change = flags;
+	r->func = cpu->func;
+#define D(col) (stat_now[col][id] - stat_last[col][id])
+	r->delta[TD_USER] = trace_delta(D(ST_USER));
+	r->delta[TD_NICE] = trace_delta(D(ST_NICE));
+	r->delta[TD_SYSTEM] = trace_delta(D(ST_SYSTEM) + D(ST_IRQ) + 
+			D(ST_SOFTIRQ));
+	r->delta[TD_IDLE] = trace_delta(D(ST_IDLE));
+	r->delta[TD_IOWAIT] = trace_delta(D(ST_IOWAIT));
+	r->delta[TD_STEAL] = trace_delta(D(ST_STEAL));
+#undef D
+	/* a -X reading the ring as we go mustn't see head before the record */
+	__atomic_store_n(&trace_ring->head, n + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Decide what every scalable unit wants from the current readings.
+ */
+void decide_all(void)
+{
+	int i;
+
+	load_all();
+	for(i=0; i<nunits; i++) {
+		if (units[i]->unit_offline) {
+			units[i]->change = SAME;
+			continue;
+		}
+		units[i]->change = decide_speed(units[i]);
+		/* -D records a repeat again once there's been a real SAME */
+		if ((units[i]->change == SAME) && (units[i]->pct >= 0))
+			units[i]->trace_last = 0;
+		/* still worked out while paused, for the control socket */
+		if (units[i]->paused) {
+			if (trace_ring && (units[i]->change != SAME))
+				trace_unit(units[i], units[i]->change, 
+						units[i]->speed_index, 0);
+			units[i]->change = SAME;
+		}
+		pprintf(6, "unit %d, change = %d\n", units[i]->cpuid,
+				units[i]->change);
+	}
+}
+
+/*
+ * First half of a poll: take one /proc/stat snapshot and decide.
+ */
+int sample_all(void)
+{
+	struct timespec now;
+	int err;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	now_ns = ts_ns(&now);
+	now_ms = now_ns / 1000000;
+
+	/* one read of /proc/stat per poll, every decision uses it */
+	if ((err = get_stat()) != 0)
+		return err;
+
+	decide_all();
+	return 0;
+}
+
+/*
+ * May cpu's unit change speed at now_ms?  Not before it has been at its
+ * current speed for residency_ms, and (with -b) not if it has used up its
+ * budget of max_rate transitions a second, which refills continuously
+ * and saves up at most a second's worth.
+ */
+static inline int rate_limited(cpuinfo_t *cpu)
+{
+	float burst;
+
+	if (now_ms < cpu->changed_ms + cpu->residency_ms)
+		return 1;
+	if (max_rate <= 0)
+		return 0;
+
+	burst = (max_rate > 1) ? max_rate : 1;
+	cpu->budget += (now_ms - cpu->budget_ms) * max_rate / 1000;
+	cpu->budget_ms = now_ms;
+	if (cpu->budget > burst)
+		cpu->budget = burst;
+	return (cpu->budget < 1);
+}
+
+/*
+ * Bring the unit's metrics up to now_ms: the time since they were last
+ * brought up to date goes to the speed it was at then, and if it's at
+ * another one now that's a transition.  Not counted while it's offline.
+ */
+static inline void account_unit(cpuinfo_t *cpu)
+{
+	unit_metrics_t *m = cpu->metrics;
+
+	if (m == NULL)
+		return;
+	if (m->since_ms && !cpu->unit_offline && (m->index < m->states))
+		m->time_ms[m->index] += now_ms - m->since_ms;
+	m->since_ms = now_ms;
+	if (cpu->speed_index == m->index)
+		return;
+	if (m->index < m->states) {
+		if (cpu->speed_index < m->index)
+			m->up++;
+		else
+			m->down++;
+		if (m->trans && (cpu->speed_index < m->states))
+			m->trans[m->index * m->states + cpu->speed_index]++;
+	}
+	m->index = cpu->speed_index;
+}
+
+/*
+ * After every poll: each unit's metrics, and its load in the histogram.
+ */
+void account_all(void)
+{
+	unit_metrics_t *m;
+	int i, b;
+
+	for (i = 0; i < nunits; i++) {
+		if ((m = units[i]->metrics) == NULL)
+			continue;
+		account_unit(units[i]);
+		if (units[i]->unit_offline || (units[i]->pct < 0))
+			continue;
+		/* the first bucket whose le it's under, LOAD_BUCKETS = +Inf */
+		b = (int)(units[i]->pct * LOAD_BUCKETS + 0.9999f) - 1;
+		m->load[(b < 0) ? 0 : (b > LOAD_BUCKETS) ? LOAD_BUCKETS : b]++;
+		m->load_sum += units[i]->pct;
+	}
+}
+
+/*
+ * Carry out the unit's decision, if the rate limits let us.
+ */
+void actuate_unit(cpuinfo_t *cpu, enum modes mode)
+{
+	unsigned int before = cpu->current_speed;
+
+	if (mode == SAME)
+		return;
+	if (rate_limited(cpu)) {
+		suppressed_count++;
+		pprintf(4, "unit %d: change suppressed\n", cpu->cpuid);
+		return;
+	}
+	change_speed(cpu, mode);
+	if (cpu->current_speed != before) {
+		cpu->budget -= 1;
+		cpu->changed_ms = now_ms;
+	}
+}
+
+/*
+ * Second half of a poll: act on what sample_all() decided.
+ */
+void actuate_all(void)
+{
+	unsigned int index, held;
+	cpuinfo_t *cpu;
+	int i;
+
+	for(i=0; i<nunits; i++) {
+		cpu = units[i];
+		index = cpu->speed_index;
+		held = suppressed_count;
+		actuate_unit(cpu, cpu->change);
+		/* only what moved, or wanted to, the rest is one branch */
+		if (trace_ring && (cpu->change != SAME))
+			trace_unit(cpu, cpu->change, index, 
+					(suppressed_count != held) ? TR_HELD : 0);
+	}
+	account_all();
+}
+
+/*
+ * Put how long a poll took in the histogram.
+ */
+static inline void account_tick(unsigned long long ns)
+{
+	double secs = ns / 1e9;
+	int b;
+
+	for (b = 0; (b < TICK_BUCKETS) && (secs > tick_le[b]); b++);
+	tick_hist[b]++;
+	tick_sum += secs;
+}
+
+/*
+ * Adaptive polling.  After each poll, if any unit's load moved by more
+ * than ADAPT_DELTA points, is within ADAPT_MARGIN points of highwater or
+ * lowwater, or the unit changed speed, drop straight to poll_min so a
+ * ramp up isn't kept waiting.  Otherwise things are steady, so double the
+ * interval, up to poll_max.  Offline and paused units aren't going to
+ * change speed whatever their load, so they don't count.
+ */
+#define ADAPT_DELTA	0.10
+#define ADAPT_MARGIN	0.05
+
+void adapt_poll(void)
+{
+	cpuinfo_t *cpu;
+	float hi, lo;
+	int i;
+
+	for (i = 0; i < nunits; i++) {
+		cpu = units[i];
+		if ((cpu->pct < 0) || cpu->unit_offline || cpu->paused)
+			continue;
+		hi = (float)cpu->highwater/100.0;
+		lo = (float)cpu->lowwater/100.0;
+		if ((cpu->change != SAME) || 
+				((cpu->pct >= hi - ADAPT_MARGIN) &&
+				 (cpu->speed_index > cpu->top_index)) ||
+				((cpu->pct <= lo + ADAPT_MARGIN) && 
+				 (cpu->speed_index < cpu->bottom_index)) ||
+				((cpu->last_pct >= 0) && 
+				 ((cpu->pct - cpu->last_pct > ADAPT_DELTA) ||
+				  (cpu->last_pct - cpu->pct > ADAPT_DELTA)))) {
+			if (poll != poll_min)
+				pprintf(3, "busy, polling every %d ms\n", 
+						poll_min);
+			poll = poll_min;
+			return;
+		}
+	}
+	if (poll < poll_max) {
+		poll = ((poll * 2) < poll_max) ? (poll * 2) : poll_max;
+		pprintf(3, "steady, polling every %d ms\n", poll);
+	}
+}
+
+/*
+ * Most machines have the same frequency table on every unit, so each
+ * distinct table is kept just once, in freq_pool, and shared.  Nothing
+ * writes to a table once it's in the pool.
+ */
+typedef struct freq_pool {
+	struct freq_pool *next;
+	int size;
+	unsigned long freqs[];
+} freq_pool_t;
+
+static freq_pool_t *freq_pool = NULL;
+
+static const unsigned long *intern_table(const unsigned long *freqs, int n)
+{
+	freq_pool_t *t;
+
+	for (t = freq_pool; t != NULL; t = t->next) {
+		if ((t->size == n) && 
+			(memcmp(t->freqs, freqs, n*sizeof(unsigned long)) == 0))
+			return t->freqs;
+	}
+	t = (freq_pool_t *)malloc(sizeof(freq_pool_t) + 
+			n*sizeof(unsigned long));
+	if (t == NULL)
+		return NULL;
+	t->size = n;
+	memcpy(t->freqs, freqs, n*sizeof(unsigned long));
+	t->next = freq_pool;
+	freq_pool = t;
+	return t->freqs;
+}
+
+void free_freq_pool(void)
+{
+	freq_pool_t *t;
+
+	while ((t = freq_pool) != NULL) {
+		freq_pool = t->next;
+		free(t);
+	}
+}
+
+/*
+ * Build cpu->freq_table, highest speed first.  avail is the contents of
+ * scaling_available_frequencies, or NULL if we don't have it (or were told
+ * to use our own step), in which case the table is made up from the min,
+ * max and cpu->step values.
+ */
+#define FREQ_TABLE_MAX 100
+
+int build_freq_table(cpuinfo_t *cpu, char *avail)
+{
+	unsigned long freqs[FREQ_TABLE_MAX], *table = freqs;
+	char *p1;
+	unsigned long temp, step;
+
+	cpu->table_size = 0;
+	if (avail == NULL) {
+		/* 
+		 * We don't have scaling_available_frequencies. build the
+		 * table from the min, max, and step values.  the driver
+		 * could ignore these, but we'll represent it this way since
+		 * we don't have any other info.
+		 */
+		step = cpu->step;
+		if (step > (cpu->max_speed - cpu->min_speed))
+			step = cpu->step = cpu->max_speed - cpu->min_speed;
+		if (step == 0)
+			step = 1;
+		cpu->table_size = ((cpu->max_speed-cpu->min_speed)/step) + 1;
+		cpu->table_size += ((cpu->max_speed-cpu->min_speed)%step)?1:0;
+		
+		if (cpu->table_size > FREQ_TABLE_MAX) {
+			table = (unsigned long *)
+				malloc(cpu->table_size*sizeof(unsigned long));
+			if (table == (unsigned long *)NULL) {
+				perror("couldn't allocate cpu->freq_table");
+				return ENOMEM;
+			}
+		}
+
+		/* populate the table.  Start at the top, and subtract step */
+		for (temp = 0; temp < cpu->table_size; temp++) {
+			table[temp] = 
+			((cpu->min_speed<(cpu->max_speed-(temp*step))) ? 
+			 (cpu->max_speed-(temp*step)) :
+			 (cpu->min_speed) );
+		}	
+	} else {
+		/* 
+		 * We do have the file, parse it and build the table from
+		 * there.
+		 */ 
+		/* The format of scaling_available_frequencies (SAF) is:
+		 * "number<space>number2<space>...numberN<space>\n", but this
+		 * can change. So we're relying on the fact that strtoul will 
+		 * return 0 if it can't find anything, and that 0 will never 
+		 * be a real value for the available frequency. 
+		 */
+		p1 = avail;
+		cpu->step = 0;
+		
+		temp = strtoul(p1, &p1, 10);
+		while((temp > 0) && (cpu->table_size < FREQ_TABLE_MAX)) {
+			table[cpu->table_size++] = temp;
+			temp = strtoul(p1, &p1, 10);
+		}
+	}
+
+	/* now lets sort the table just to be sure */
+	qsort(table, cpu->table_size, sizeof(unsigned long), &faked_compare);
+
+	cpu->freq_table = intern_table(table, cpu->table_size);
+	if (table != freqs)
+		free(table);
+	if (cpu->freq_table == NULL) {
+		perror("Couldn't allocate cpu->freq_table\n");
+		return ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * Initialises the cpufreq side of a scalable unit, through the sysfs_dir
+ * of the cpu that leads it.
+ */
+int get_per_cpu_info(cpuinfo_t *cpu)
+{
+	char scratch[PATH_MAX];
+	unsigned int latency;
+	unsigned long temp;
+	int i, err;
+	
+	snprintf(scratch, sizeof(scratch), "%scpuinfo_max_freq", 
+			cpu->sysfs_dir);
+	if ((err = read_file(scratch, 0, 1)) != 0) {
+		return err;
+	}
+	
+	cpu->max_speed = strtol(buf, NULL, 10);
+	
+	snprintf(scratch, sizeof(scratch), "%scpuinfo_min_freq", cpu->sysfs_dir);
+
+	if ((err = read_file(scratch, 0, 1)) != 0) {
+		return err;
+	}
+
+	cpu->min_speed = strtol(buf, NULL, 10);
+
+	/* 
+	 * More error handling, make sure step is not larger than the 
+	 * difference between max and min speeds. If so, truncate it.
+	 */
+	if (step > (cpu->max_speed - cpu->min_speed)) {
+		step = cpu->max_speed - cpu->min_speed;
+	}
+	
+	/* assume full speed until we've read scaling_cur_freq, below */
+	cpu->current_speed = cpu->max_speed;
+	cpu->speed_index = 0;
+
+	snprintf(scratch, sizeof(scratch), "%sscaling_available_frequencies", cpu->sysfs_dir);
+
+	err = read_file(scratch, 0, 1);
+	cpu->step = step;
+	if ((err = build_freq_table(cpu, 
+			((err != 0) || (step_specified)) ? NULL : buf)) != 0)
+		return err;
+	
+	/*
+	 * Some cpufreq drivers (longhaul) report speeds in MHz instead
+	 * of KHz.  Assume for now that any currently supported cpufreq 
+	 * processor will a) not be faster then 10GHz, and b) not be slower
+	 * then 10MHz. Therefore, is the number for max_speed is less than
+	 * 10000, assume the driver is reporting speeds in MHz, not KHz,
+	 * and adjust accordingly.
+	 *
+	 * XXXjc the longhaul driver has been fixed (2.6.5ish timeframe)
+	 * so this should't be needed anymore.  Remove for 1.0?
+	 */
+	cpu->in_mhz = 0;
+	if (cpu->max_speed <= 10000) {
+		cpu->in_mhz = 1;
+		cpu->max_speed *= 1000;
+		cpu->min_speed *= 1000;
+		cpu->current_speed *= 1000;
+	}
+
+	/*
+	 * Like the kernel's own governors, don't change speed more often
+	 * than every 1000 transition latencies (latency is in nsecs, so
+	 * that's latency/1000 msecs), or -M, whichever is longer.  Drivers
+	 * that don't know their latency say CPUFREQ_ETERNAL (-1).
+	 */
+	cpu->residency_ms = min_residency;
+	snprintf(scratch, sizeof(scratch), "%scpuinfo_transition_latency", 
+			cpu->sysfs_dir);
+	if (read_file(scratch, 0, 1) == 0) {
+		latency = strtoul(buf, NULL, 10);
+		if ((latency != (unsigned int)-1) && 
+				(latency / 1000 > cpu->residency_ms))
+			cpu->residency_ms = latency / 1000;
+	}
+
+	/* 
+	 * Keep the policy's limits open, they're re-read as we go.  Start
+	 * inside them (and -U/-L), we assumed full speed above.
+	 */
+	snprintf(scratch, sizeof(scratch), "%sscaling_max_freq", 
+			cpu->sysfs_dir);
+	cpu->maxfreq_fd = open(scratch, coexist ? O_RDWR : O_RDONLY);
+	snprintf(scratch, sizeof(scratch), "%sscaling_min_freq", 
+			cpu->sysfs_dir);
+	cpu->minfreq_fd = open(scratch, coexist ? O_RDWR : O_RDONLY);
+	cpu->orig_max = read_freq(cpu->maxfreq_fd);
+	cpu->orig_min = read_freq(cpu->minfreq_fd);
+	clip_table(cpu, cpu->orig_max, cpu->orig_min);
+
+	/* and start from the speed we're really at */
+	snprintf(scratch, sizeof(scratch), "%sscaling_cur_freq", 
+			cpu->sysfs_dir);
+	cpu->curfreq_fd = open(scratch, O_RDONLY);
+	if ((temp = read_freq(cpu->curfreq_fd)) != 0) {
+		cpu->speed_index = nearest_index(cpu, temp);
+		for (i = 0; i < cpu->nsiblings; i++) {
+			all_cpus[cpu->siblings[i]]->current_speed = 
+				cpu->freq_table[cpu->speed_index];
+		}
+		cpu->last_written = cpu->current_speed;
+	}
+
+	if (coexist && ((cpu->maxfreq_fd < 0) || (cpu->minfreq_fd < 0))) {
+		err = errno;
+		perror("Can't open scaling_min/max_freq for writing");
+		return err;
+	}
+	return alloc_metrics(cpu);
+}
+
+/*
+ * Make sure the unit is run by the userspace governor, or with -k just
+ * say which one we're leaving in charge.  Only touches the unit and
+ * local buffers, so units can be done in parallel (see check_governors()).
+ */
+int check_governor(cpuinfo_t *cpu)
+{
+	char scratch[PATH_MAX], gov[64], *p1;
+	int fd, n, err;
+
+	snprintf(scratch, sizeof(scratch), "%sscaling_governor", 
+			cpu->sysfs_dir);
+	if ((fd = open(scratch, coexist ? O_RDONLY : O_RDWR)) < 0) {
+		err = errno;
+		perror("couldn't open scaling_governor file");
+		return err;
+	}
+	if ((n = pread(fd, gov, sizeof(gov) - 1, 0)) < 0) {
+		err = errno;
+		perror("couldn't read scaling_governor file");
+		close(fd);
+		return err;
+	}
+	gov[n] = '\0';
+	if ((p1 = strchr(gov, '\n')) != NULL)
+		*p1 = '\0';
+
+	if (coexist) {
+		/* leave it be, -k steers whatever governor is there */
+		pprintf(1, "cpu%d: keeping the %s governor\n", cpu->cpuid, gov);
+		close(fd);
+		return 0;
+	}
+	if (strcmp(gov, "userspace") == 0) {
+		close(fd);
+		return 0;
+	}
+
+	if (pwrite(fd, "userspace\n", 10, 0) < 0) {
+		err = errno;
+		perror("Error writing file governor");
+		close(fd);
+		return err;
+	}
+	n = pread(fd, gov, sizeof(gov) - 1, 0);
+	close(fd);
+	if ((n < 9) || (strncmp(gov, "userspace", 9) != 0)) {
+		perror("Can't set to userspace governor, exiting");
+		return EPIPE;
+	}
+	return 0;
+}
+
+/*
+ * Governor switches are the slow part of starting up: the kernel stops
+ * one governor and starts the other under the policy's lock.  Policies
+ * don't share locks, so on big machines do them from a few threads.
+ */
+#define GOV_THREADS_MAX 32
+static int gov_next = 0;
+static int gov_err = 0;
+
+static void *governor_worker(void *arg)
+{
+	int i, err;
+
+	while ((i = __sync_fetch_and_add(&gov_next, 1)) < nunits) {
+		if (units[i]->unit_offline)
+			continue;
+		if ((err = check_governor(units[i])) != 0)
+			__sync_bool_compare_and_swap(&gov_err, 0, err);
+	}
+	return NULL;
+}
+
+int check_governors(void)
+{
+	pthread_t threads[GOV_THREADS_MAX];
+	long nthreads;
+	int i, started = 0;
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > nunits)
+		nthreads = nunits;
+	if (nthreads > GOV_THREADS_MAX)
+		nthreads = GOV_THREADS_MAX;
+
+	gov_next = 0;
+	gov_err = 0;
+	/* this thread is one of them */
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[started], NULL, 
+					&governor_worker, NULL) != 0)
+			break;
+		started++;
+	}
+	governor_worker(NULL);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	return gov_err;
+}
+
+/*
+ * Last step of bringing a unit up, once its governor is sorted out: put
+ * its speed inside the limits, or with -k box the governor in.
+ */
+int settle_unit(cpuinfo_t *cpu)
+{
+	if (coexist) {
+		/* box the governor in from the start */
+		cpu->band_min = cpu->orig_min;
+		cpu->band_max = cpu->orig_max;
+		cpu->last_written = 0;
+		return set_speed_index(cpu);
+	}
+	if ((cpu->speed_index < cpu->top_index) || 
+			(cpu->speed_index > cpu->bottom_index))
+		return set_speed_index(cpu);
+	
+	return 0;
+}
+
+/*
+ * Called on SIGTERM/SIGINT (from the main loop)... clean up after ourselves
+ */
+void terminate(int signum)
+{
+	int i;
+	cpuinfo_t *cpu;
+	
+	/* 
+	 * for each unit, force it back to full speed.
+	 * don't mix this with the below statement.
+	 * 
+	 * 5 minutes ago I convinced myself you couldn't 
+	 * mix these two, now I can't remember why.  
+	 */
+	for(i = 0; i < nunits; i++) {
+		cpu = units[i];
+		if (cpu->unit_offline)
+			continue;
+		if (coexist) {
+			/* give the governor its own limits back */
+			if (cpu->band_max && cpu->orig_max) {
+				write_freq(cpu->maxfreq_fd, cpu->orig_max);
+				write_freq(cpu->minfreq_fd, cpu->orig_min);
+			}
+			continue;
+		}
+		cpu->func = LEAPS;
+		change_speed(cpu, RAISE);
+	}
+
+	/* the counters as they stood, putting full speed back isn't counted */
+	if (metrics_src.fd >= 0) {
+		save_metrics();
+		close(metrics_src.fd);
+	}
+	if (trace_ring)
+		munmap(trace_ring, sizeof(trace_header_t) + 
+				TRACE_RECORDS * sizeof(trace_record_t));
+
+	for(i = 0; i < ncpus; i++) {
+		cpu = all_cpus[i];
+		if (cpu->setspeed_fd >= 0)
+			close(cpu->setspeed_fd);
+		if (cpu->maxfreq_fd >= 0)
+			close(cpu->maxfreq_fd);
+		if (cpu->minfreq_fd >= 0)
+			close(cpu->minfreq_fd);
+		if (cpu->curfreq_fd >= 0)
+			close(cpu->curfreq_fd);
+		/* deallocate everything */
+		free(cpu->sysfs_dir);
+		free(cpu->metrics);
+	}
+	free(arena);
+	free(all_cpus);
+	free(units);
+	free_freq_pool();
+	close(stat_fd);
+	close(timer_src.fd);
+	close(signal_src.fd);
+	if (psi_src.fd >= 0)
+		close(psi_src.fd);
+	if (hotplug_src.fd >= 0)
+		close(hotplug_src.fd);
+	if (ctl_src.fd >= 0) {
+		close(ctl_src.fd);
+		unlink(ctl_path);
+		for (i = 0; i < CTL_CLIENTS; i++) {
+			if (ctl_clients[i].src.fd >= 0)
+				close(ctl_clients[i].src.fd);
+		}
+	}
+	free(ctl_reply);
+	free(now_online);
+	free(online_list);
+	close(epoll_fd);
+	free(statbuf);
+	time_t duration = time(NULL) - start_time;
+	pprintf(1,"Statistics:\n");
+	pprintf(1,"  %d speed changes in %d seconds\n",
+			change_speed_count, (unsigned int) duration);
+	if (psi_trigger)
+		pprintf(1,"  %d cpu pressure wakeups\n", psi_wakeups);
+	pprintf(1,"  %d cpu hotplug events\n", hotplug_count);
+	pprintf(1,"  %d speed changes suppressed by rate limits\n",
+			suppressed_count);
+	pprintf(1,"  %d times the speed wasn't what we set\n", drift_count);
+	pprintf(0,"PowerNow Daemon Exiting.\n");
+
+	closelog();
+
+	exit(0);
+}
+
+int add_event_source(event_source_t *src, int fd, uint32_t events,
+		void (*handler)(event_source_t *))
+{
+	struct epoll_event ev;
+	int err;
+
+	src->fd = fd;
+	src->handler = handler;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = src;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		err = errno;
+		perror("Couldn't add event source");
+		return err;
+	}
+	return 0;
+}
+
+/*
+ * Arm the timer for poll msecs after the last deadline (not after now), so
+ * the time spent polling doesn't push the next poll back and the period
+ * doesn't drift.  If we've fallen whole polls behind, skip them.
+ */
+int arm_timer(void)
+{
+	struct itimerspec its;
+	struct timespec now;
+	unsigned long long next, period, late;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	period = poll * 1000000ULL;
+	next = ts_ns(&next_tick) + period;
+	if (next <= ts_ns(&now)) {
+		late = ts_ns(&now) - next;
+		next += ((late / period) + 1) * period;
+	}
+	next_tick.tv_sec = next / 1000000000ULL;
+	next_tick.tv_nsec = next % 1000000000ULL;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value = next_tick;
+	if (timerfd_settime(timer_src.fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		perror("Couldn't arm poll timer");
+		return errno;
+	}
+	return 0;
+}
+
+void timer_event(event_source_t *src)
+{
+	struct timespec t0, t1;
+	uint64_t expirations;
+	int i;
+
+	if (read(src->fd, &expirations, sizeof(expirations)) < 0)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (++limit_polls >= LIMIT_POLLS) {
+		limit_polls = 0;
+		update_online();
+		for (i = 0; i < nunits; i++) {
+			if (units[i]->unit_offline)
+				continue;
+			check_speed(units[i]);
+			check_limits(units[i]);
+		}
+	}
+	if (sample_all() == 0) {
+		actuate_all();
+		if (adaptive)
+			adapt_poll();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	account_tick(ts_ns(&t1) - ts_ns(&t0));
+	arm_timer();
+}
+
+void signal_event(event_source_t *src)
+{
+	struct signalfd_siginfo si;
+
+	if (read(src->fd, &si, sizeof(si)) != sizeof(si))
+		return;
+	terminate(si.ssi_signo);
+}
+
+/*
+ * The pressure trigger fired: something has been waiting for a cpu for
+ * too long.  Don't wait for the timer, take a snapshot now and raise the
+ * units that are busy.  This only ever raises, lowering is left to the
+ * periodic poll.
+ *
+ * The wakeup mustn't disturb the polls: its snapshot goes in the scratch
+ * columns, measured from the last poll's, and the poll's pair is put back
+ * after, so the next poll still sees its whole interval.  It decides on
+ * the raw loads, leaving the -e/-w history alone, and each unit's load
+ * and -i boost are put back once it's been raised.
+ */
+void pressure_event(event_source_t *src)
+{
+	unsigned long long *poll_now[NSTAT], *poll_last[NSTAT];
+	struct timespec now;
+	unsigned int index, held;
+	float pct, last_pct, io_boost;
+	char scratch[64];
+	int i, busiest;
+	cpuinfo_t *u;
+
+	/* the stand-in fifo has to be drained, the real trigger doesn't */
+	if (psi_fifo)
+		while (read(src->fd, scratch, sizeof(scratch)) > 0);
+
+	psi_wakeups++;
+	pprintf(3, "cpu pressure, looking for units to raise\n");
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	now_ns = ts_ns(&now);
+	now_ms = now_ns / 1000000;
+
+	memcpy(poll_now, stat_now, sizeof(poll_now));
+	memcpy(poll_last, stat_last, sizeof(poll_last));
+	/* parse_stat() swaps, so this makes the poll's snapshot the last */
+	memcpy(stat_last, stat_scratch, sizeof(stat_last));
+	if (get_stat() != 0)
+		goto out;
+	load_kernel();
+	vote_kernel();
+	for (i=0; i<nunits; i++) {
+		u = units[i];
+		if (u->unit_offline)
+			continue;
+		pct = u->pct;
+		last_pct = u->last_pct;
+		busiest = u->busiest;
+		io_boost = u->io_boost;
+		if ((decide_speed(u) == RAISE) && !u->paused) {
+			index = u->speed_index;
+			held = suppressed_count;
+			actuate_unit(u, RAISE);
+			account_unit(u);
+			if (trace_ring)
+				trace_unit(u, RAISE, index, TR_PRESSURE |
+					((suppressed_count != held) ? TR_HELD : 0));
+		}
+		u->pct = pct;
+		u->last_pct = last_pct;
+		u->busiest = busiest;
+		u->io_boost = io_boost;
+	}
+out:
+	memcpy(stat_now, poll_now, sizeof(stat_now));
+	memcpy(stat_last, poll_last, sizeof(stat_last));
+}
+
+/*
+ * Register psi_trigger with the kernel (see Documentation/accounting/psi)
+ * and wait for POLLPRI on it.  If the pressure file is a fifo (a fake
+ * tree, see make_fake_tree()) anything written to it fires instead.
+ */
+int setup_pressure(void)
+{
+	struct stat st;
+	int fd, err;
+
+	if ((fd = open(proc_pressure, O_RDWR|O_NONBLOCK|O_CLOEXEC)) < 0) {
+		err = errno;
+		perror(proc_pressure);
+		return err;
+	}
+	if ((fstat(fd, &st) == 0) && S_ISFIFO(st.st_mode)) {
+		psi_fifo = 1;
+		pprintf(1, "%s is a fifo, using it as the pressure trigger\n",
+				proc_pressure);
+	} else if (write(fd, psi_trigger, strlen(psi_trigger) + 1) < 0) {
+		err = errno;
+		perror("Couldn't register cpu pressure trigger");
+		close(fd);
+		return err;
+	}
+	return add_event_source(&psi_src, fd, psi_fifo ? EPOLLIN : EPOLLPRI,
+			&pressure_event);
+}
+
+/*
+ * Set up the epoll set, the poll timer and the exit signals.  SIGTERM and
+ * SIGINT are blocked and read from a signalfd, so terminate() runs from
+ * the main loop and not in a signal handler.
+ */
+int setup_events(void)
+{
+	sigset_t mask;
+	int fd, err;
+
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		err = errno;
+		perror("epoll_create1");
+		return err;
+	}
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	if ((fd = signalfd(-1, &mask, SFD_CLOEXEC)) < 0) {
+		err = errno;
+		perror("signalfd");
+		return err;
+	}
+	if ((err = add_event_source(&signal_src, fd, EPOLLIN, 
+					&signal_event)) != 0)
+		return err;
+
+	if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0) {
+		err = errno;
+		perror("timerfd_create");
+		return err;
+	}
+	if ((err = add_event_source(&timer_src, fd, EPOLLIN, 
+					&timer_event)) != 0)
+		return err;
+
+	if (psi_trigger && ((err = setup_pressure()) != 0))
+		return err;
+	if ((err = setup_hotplug()) != 0)
+		return err;
+	if (ctl_path && ((err = setup_control()) != 0))
+		return err;
+	if (metrics_path && ((err = setup_metrics()) != 0))
+		return err;
+
+	clock_gettime(CLOCK_MONOTONIC, &next_tick);
+	return arm_timer();
+}
+
+/*
+ * Wait for events and hand them out, forever.
+ */
+void event_loop(void)
+{
+	struct epoll_event events[8];
+	event_source_t *src;
+	int i, n;
+
+	while (1) {
+		n = epoll_wait(epoll_fd, events, 8, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			terminate(0);
+		}
+		for (i = 0; i < n; i++) {
+			src = (event_source_t *)events[i].data.ptr;
+			src->handler(src);
+		}
+	}
+}
+
+const char *str_func(enum function f)
+{
+	switch (f) {
+		case SINE: return "SINE";
+		case AGGRESSIVE: return "AGGRESSIVE";
+		case PASSIVE: return "PASSIVE";
+		case LEAPS: return "LEAPS";
+		case TARGET: return "TARGET";
+		default: return "UNKNOWN";
+	}
+}
+
+/*
+ * Read a list of cpus from p into cpus[], at most max of them.  Takes both
+ * the "0 1 2 3" format of related_cpus/affected_cpus and the "0-3,8-11"
+ * format of the online/possible masks.  Returns how many there were.
+ */
+int parse_cpu_list(char *p, int *cpus, int max)
+{
+	int n = 0, first, last;
+	char *p1;
+
+	while (n < max) {
+		while (*p == ' ' || *p == ',' || *p == '\t')
+			p++;
+		first = strtol(p, &p1, 10);
+		if (p1 == p)
+			break;
+		last = first;
+		if (*p1 == '-')
+			last = strtol(p1+1, &p1, 10);
+		for (; (first <= last) && (n < max); first++)
+			cpus[n++] = first;
+		p = p1;
+	}
+	return n;
+}
+
+/*
+ * Make the cpus in cpus[] one scalable unit, driven through the cpufreq
+ * directory dir (NULL when simulating).  The lowest numbered cpu leads it
+ * and carries all of the unit's state.  Cpus we don't know about or that
+ * already belong to a unit are skipped.
+ */
+int add_unit(const char *dir, int *cpus, int n)
+{
+	cpuinfo_t *cpu;
+	int i, lead = -1, count = 0;
+
+	for (i = 0; i < n; i++) {
+		if ((cpus[i] < 0) || (cpus[i] >= ncpus) || 
+				(all_cpus[cpus[i]]->scalable_unit >= 0))
+			continue;
+		cpus[count++] = cpus[i];
+		if ((lead < 0) || (cpus[i] < lead))
+			lead = cpus[i];
+	}
+	if (count == 0)
+		return 0;
+
+	cpu = all_cpus[lead];
+	if (dir && ((cpu->sysfs_dir = strdup(dir)) == NULL)) {
+		perror("Couldn't allocate sysfs_dir");
+		return ENOMEM;
+	}
+	/* a cpu joins one unit at most, so the pool can't run out */
+	cpu->siblings = sibling_pool + siblings_used;
+	siblings_used += count;
+	memcpy(cpu->siblings, cpus, count*sizeof(int));
+	cpu->nsiblings = count;
+	for (i = 0; i < count; i++)
+		all_cpus[cpus[i]]->scalable_unit = lead;
+	unit_settings(cpu);
+	units[nunits++] = cpu;
+	return 0;
+}
+
+/*
+ * Static grouping: n cpus to a unit, numbered next to each other.  This
+ * is what -c asks for, and what the simulator uses.
+ */
+int group_units_static(int n)
+{
+	char dir[PATH_MAX];
+	int i, j, cpus[n], err;
+
+	for (i = 0; i < ncpus; i += n) {
+		for (j = 0; j < n; j++)
+			cpus[j] = i + j;
+		snprintf(dir, sizeof(dir), "%scpu%d/cpufreq/", sysfs_tree, i);
+		if ((err = add_unit(simulate ? NULL : dir, cpus, 
+						(i + n > ncpus) ? ncpus - i : n)) != 0)
+			return err;
+	}
+	return 0;
+}
+
+static int unit_compare(const void *a, const void *b)
+{
+	return (*(cpuinfo_t **)a)->cpuid - (*(cpuinfo_t **)b)->cpuid;
+}
+
+/*
+ * The cpus sharing a cpufreq directory: related_cpus, or affected_cpus on
+ * kernels that don't have that.  Returns how many, 0 if neither is there.
+ */
+static int read_siblings(const char *dir, int *cpus)
+{
+	char filename[PATH_MAX];
+	int n = 0;
+
+	snprintf(filename, sizeof(filename), "%srelated_cpus", dir);
+	if (read_file(filename, 0, 1) == 0)
+		n = parse_cpu_list(buf, cpus, ncpus);
+	if (n == 0) {
+		snprintf(filename, sizeof(filename), "%saffected_cpus", dir);
+		if (read_file(filename, 0, 1) == 0)
+			n = parse_cpu_list(buf, cpus, ncpus);
+	}
+	return n;
+}
+
+/*
+ * Find the scalable units.  Each cpufreq policy (cpufreq/policyN) is one,
+ * made up of the cpus in its related_cpus.  Those can be any number of
+ * cpus, and needn't be numbered next to each other (cpu0 and cpu64 are
+ * hyperthread siblings on plenty of servers).  Kernels before 4.3 don't
+ * have policyN directories, so there we go through the cpus' own cpufreq
+ * directories instead, and a cpu that doesn't list its siblings is a unit
+ * on its own.  -c overrides all this with a static grouping.
+ */
+int discover_units(void)
+{
+	char dir[PATH_MAX];
+	struct dirent *de;
+	DIR *d;
+	int i, n, policies, err = 0, *cpus;
+
+	if (cores_specified)
+		return group_units_static(t_per_core);
+
+	if ((cpus = (int *)malloc(ncpus*sizeof(int))) == NULL) {
+		perror("Couldn't allocate cpu list");
+		return ENOMEM;
+	}
+
+	snprintf(dir, sizeof(dir), "%scpufreq", sysfs_tree);
+	if ((d = opendir(dir)) != NULL) {
+		while ((de = readdir(d)) != NULL) {
+			if (strncmp(de->d_name, "policy", 6) != 0)
+				continue;
+			snprintf(dir, sizeof(dir), "%scpufreq/%s/", sysfs_tree,
+					de->d_name);
+			n = read_siblings(dir, cpus);
+			if ((err = add_unit(dir, cpus, n)) != 0)
+				break;
+		}
+		closedir(d);
+	}
+	policies = nunits;
+
+	for (i = 0; (policies == 0) && (err == 0) && (i < ncpus); i++) {
+		if (all_cpus[i]->scalable_unit >= 0)
+			continue;
+		snprintf(dir, sizeof(dir), "%scpu%d/cpufreq/", sysfs_tree, i);
+		if ((n = read_siblings(dir, cpus)) == 0) {
+			cpus[0] = i;
+			n = 1;
+		}
+		err = add_unit(dir, cpus, n);
+	}
+
+	free(cpus);
+	qsort(units, nunits, sizeof(cpuinfo_t *), &unit_compare);
+	return err;
+}
+
+void show_unit(cpuinfo_t *cpu);
+
+/*
+ * Bring up a unit on its own (hotplug): read its cpufreq setup, sort out
+ * its governor and tell the user about it.  At startup main() does these
+ * steps for all the units together.
+ */
+int start_unit(cpuinfo_t *cpu)
+{
+	int err;
+
+	if (((err = get_per_cpu_info(cpu)) != 0) || 
+			((err = check_governor(cpu)) != 0) ||
+			((err = settle_unit(cpu)) != 0))
+		return err;
+	show_unit(cpu);
+	return 0;
+}
+
+/*
+ * Tell the user about a unit we've just brought up.
+ */
+void show_unit(cpuinfo_t *cpu)
+{
+	int j, len;
+
+	cpu->needs_init = 0;
+	pprintf(0,"  cpu%d (%d cpu%s): %dMhz - %dMhz (%d steps)\n", 
+			cpu->cpuid,
+			cpu->nsiblings, (cpu->nsiblings>1)?"s":"",
+			cpu->min_speed / 1000, 
+			cpu->max_speed / 1000, 
+			cpu->table_size);
+	for(j=0, len=0; (j<cpu->nsiblings) && (len<sizeof(buf)-12); j++)
+		len += sprintf(buf+len, " %d", cpu->siblings[j]);
+	pprintf(1, "     cpus:%s\n", buf);
+	for(j=0;j<cpu->table_size; j++) {
+		pprintf(1, "     step%d : %ldMhz\n", j+1, 
+				cpu->freq_table[j] / 1000);
+	}
+}
+
+/*
+ * A unit is offline when all of its cpus are.
+ */
+static int unit_is_offline(cpuinfo_t *cpu)
+{
+	int i;
+
+	for (i = 0; i < cpu->nsiblings; i++) {
+		if (!all_cpus[cpu->siblings[i]]->offline)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * One of the unit's cpus came or went.  A unit coming back may have been
+ * moved while we weren't looking, so its limits and speed are re-read
+ * and the next speed we pick is written whatever we wrote before.  One
+ * that was never up gets its first look at sysfs now.
+ */
+int update_unit(cpuinfo_t *cpu)
+{
+	int offline = unit_is_offline(cpu);
+
+	if (offline == cpu->unit_offline)
+		return 0;
+	cpu->unit_offline = offline;
+	if (offline) {
+		pprintf(1, "unit %d is offline\n", cpu->cpuid);
+		/* its last load means nothing now, or when it's back */
+		cpu->pct = cpu->last_pct = -1;
+		return 0;
+	}
+
+	pprintf(1, "unit %d is online\n", cpu->cpuid);
+	if (cpu->needs_init)
+		return start_unit(cpu);
+	cpu->last_written = 0;
+	check_speed(cpu);
+	check_limits(cpu);
+	return 0;
+}
+
+/*
+ * A cpu that's in no unit came online, probably for the first time, so
+ * the kernel has just made its cpufreq policy.  Make a unit of it.
+ */
+int hotplug_unit(int id)
+{
+	char dir[PATH_MAX];
+	cpuinfo_t *cpu;
+	int n, err;
+
+	snprintf(dir, sizeof(dir), "%scpu%d/cpufreq/", sysfs_tree, id);
+	if ((n = read_siblings(dir, online_list)) == 0) {
+		pprintf(1, "cpu%d has no cpufreq policy, ignoring it\n", id);
+		return 0;
+	}
+	if ((err = add_unit(dir, online_list, n)) != 0)
+		return err;
+	if (all_cpus[id]->scalable_unit < 0)
+		return 0;
+	cpu = all_cpus[all_cpus[id]->scalable_unit];
+	/* update_unit() below starts it */
+	cpu->unit_offline = cpu->needs_init = 1;
+	qsort(units, nunits, sizeof(cpuinfo_t *), &unit_compare);
+	return 0;
+}
+
+/*
+ * Re-read the online mask and deal with just the cpus that changed.
+ */
+int update_online(void)
+{
+	char filename[PATH_MAX];
+	cpuinfo_t *cpu;
+	int i, n, err;
+
+	snprintf(filename, sizeof(filename), "%sonline", sysfs_tree);
+	if ((err = read_file(filename, 0, 1)) != 0)
+		return err;
+	n = parse_cpu_list(buf, online_list, ncpus);
+	memset(now_online, 0, ncpus);
+	for (i = 0; i < n; i++) {
+		if ((online_list[i] >= 0) && (online_list[i] < ncpus))
+			now_online[online_list[i]] = 1;
+	}
+
+	for (i = 0; i < ncpus; i++) {
+		cpu = all_cpus[i];
+		if (cpu->offline != now_online[i])
+			continue;
+		cpu->offline = !now_online[i];
+		pprintf(2, "cpu%d is %s\n", i, 
+				cpu->offline ? "offline" : "online");
+		if ((cpu->scalable_unit < 0) && !cpu->offline &&
+				((err = hotplug_unit(i)) != 0))
+			return err;
+		if ((cpu->scalable_unit >= 0) && ((err = 
+				update_unit(all_cpus[cpu->scalable_unit])) != 0))
+			return err;
+	}
+	return 0;
+}
+
+void hotplug_event(event_source_t *src)
+{
+	char msg[4096];
+	ssize_t len;
+	int cpu_event = 0;
+
+	/* "online@/devices/system/cpu/cpu3\0ACTION=online\0..." */
+	while ((len = read(src->fd, msg, sizeof(msg) - 1)) > 0) {
+		msg[len] = '\0';
+		if (hotplug_fifo || 
+				(strstr(msg, "@/devices/system/cpu/cpu") != NULL))
+			cpu_event = 1;
+	}
+	if (cpu_event) {
+		hotplug_count++;
+		update_online();
+	}
+}
+
+/*
+ * Listen for the kernel's uevents, or under -r for writes to the fake
+ * tree's uevent fifo.  If we can't, the periodic re-read has to do.
+ */
+int setup_hotplug(void)
+{
+	char filename[PATH_MAX];
+	struct sockaddr_nl sa;
+	struct stat st;
+	int fd;
+
+	if (root_dir) {
+		snprintf(filename, sizeof(filename), "%suevent", sysfs_tree);
+		if ((stat(filename, &st) != 0) || !S_ISFIFO(st.st_mode))
+			return 0;
+		if ((fd = open(filename, O_RDWR|O_NONBLOCK|O_CLOEXEC)) < 0)
+			return 0;
+		hotplug_fifo = 1;
+	} else {
+		fd = socket(AF_NETLINK, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC,
+				NETLINK_KOBJECT_UEVENT);
+		memset(&sa, 0, sizeof(sa));
+		sa.nl_family = AF_NETLINK;
+		sa.nl_groups = 1;
+		if ((fd < 0) || 
+			(bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)) {
+			perror("Can't listen for cpu hotplug uevents");
+			if (fd >= 0)
+				close(fd);
+			return 0;
+		}
+	}
+	return add_event_source(&hotplug_src, fd, EPOLLIN, &hotplug_event);
+}
+
+/*
+ * Control socket (-C).  A unix stream socket, only root may use it, that
+ * takes one command a line and answers each with its output, if any, and
+ * then "ok" or "error <why>":
+ *
+ *	get <unit> <key>		one of a unit's settings
+ *	set <unit>|all <key> <value>...	one or more settings, all or none
+ *	pause [<unit>|all]		leave the speed alone
+ *	resume [<unit>|all]		go back to deciding it
+ *	dump				a line on every unit
+ *
+ * A unit is named by any of its cpus.  The keys are func (a mode, by
+ * number or name), highwater, lowwater, step (kHz, the unit's table is
+ * rebuilt from its min and max) and poll.  Every unit is decided from the
+ * same /proc/stat snapshot, so poll can only be set for all of them.
+ * Commands are run from the main loop, between ticks, so a tick never
+ * sees half a change.
+ */
+enum ctl_keys {
+	KEY_FUNC,
+	KEY_HIGHWATER,
+	KEY_LOWWATER,
+	KEY_STEP,
+	KEY_POLL,
+	NKEYS
+};
+static const char *ctl_keys[NKEYS] = {
+	"func", "highwater", "lowwater", "step", "poll"
+};
+
+static int ctl_key(const char *s)
+{
+	int key;
+
+	for (key = 0; key < NKEYS; key++) {
+		if (strcmp(s, ctl_keys[key]) == 0)
+			return key;
+	}
+	return -1;
+}
+
+/* the unit cpu s is in, NULL if there's no such thing */
+static cpuinfo_t *ctl_unit(const char *s)
+{
+	char *end;
+	long id;
+
+	id = strtol(s, &end, 10);
+	if ((*s == '\0') || (*end != '\0') || (id < 0) || (id >= ncpus) ||
+			(all_cpus[id]->scalable_unit < 0))
+		return NULL;
+	return all_cpus[all_cpus[id]->scalable_unit];
+}
+
+/* a mode by name or number, -1 if it's neither */
+static long ctl_func(const char *s)
+{
+	char *end;
+	long f;
+
+	for (f = 0; f < NFUNCS; f++) {
+		if (strcasecmp(s, str_func(f)) == 0)
+			return f;
+	}
+	f = strtol(s, &end, 10);
+	if ((*s == '\0') || (*end != '\0') || (f < 0) || (f >= NFUNCS))
+		return -1;
+	return f;
+}
+
+/*
+ * Build in t, a copy of the unit, the table it would have with a new step
+ * and the metrics to go with it, leaving the unit itself alone.  Like
+ * get_per_cpu_info(), build it in the driver's units: max_speed and
+ * min_speed have been scaled up to kHz for in_mhz drivers, the table and
+ * the step haven't.
+ */
+static int ctl_build_table(cpuinfo_t *cpu, cpuinfo_t *t, 
+		unsigned int new_step)
+{
+	int err;
+
+	*t = *cpu;
+	t->step = new_step;
+	t->metrics = NULL;
+	if (t->in_mhz) {
+		t->max_speed /= 1000;
+		t->min_speed /= 1000;
+	}
+	if ((err = build_freq_table(t, NULL)) != 0)
+		return err;
+	return alloc_metrics(t);
+}
+
+/*
+ * Switch a unit to the table ctl_build_table() made for it, clip it as
+ * before and move to the entry nearest the speed it's at.  Nothing here
+ * can fail: a speed that doesn't get written is retried next time.
+ */
+static void ctl_retable(cpuinfo_t *cpu, cpuinfo_t *t)
+{
+	unsigned long speed = cpu->freq_table[cpu->speed_index];
+
+	cpu->step = t->step;
+	cpu->freq_table = t->freq_table;
+	cpu->table_size = t->table_size;
+	free(cpu->metrics);
+	cpu->metrics = t->metrics;
+	if (coexist)
+		clip_table(cpu, cpu->orig_max, cpu->orig_min);
+	else
+		clip_table(cpu, read_freq(cpu->maxfreq_fd), 
+				read_freq(cpu->minfreq_fd));
+	cpu->speed_index = nearest_index(cpu, speed);
+	set_speed_index(cpu);
+	if (cpu->metrics)
+		cpu->metrics->index = cpu->speed_index;
+}
+
+/*
+ * Add to the reply.  Once something doesn't fit, nothing more is added
+ * and the command fails instead.
+ */
+static void ctl_printf(const char *fmt, ...)
+{
+	size_t room = CTL_REPLY - ctl_reply_len;
+	va_list ap;
+	int n;
+
+	if (ctl_reply_full)
+		return;
+	va_start(ap, fmt);
+	n = vsnprintf(ctl_reply + ctl_reply_len, room, fmt, ap);
+	va_end(ap);
+	if ((n < 0) || (n >= room))
+		ctl_reply_full = 1;
+	else
+		ctl_reply_len += n;
+}
+
+static const char *ctl_get(int argc, char **argv)
+{
+	cpuinfo_t *cpu;
+
+	if (argc != 3)
+		return "usage: get <unit> <key>";
+	if ((cpu = ctl_unit(argv[1])) == NULL)
+		return "no such unit";
+	switch (ctl_key(argv[2])) {
+		case KEY_FUNC:
+			ctl_printf("func %s\n", str_func(cpu->func));
+			break;
+		case KEY_HIGHWATER:
+			ctl_printf("highwater %u\n", cpu->highwater);
+			break;
+		case KEY_LOWWATER:
+			ctl_printf("lowwater %u\n", cpu->lowwater);
+			break;
+		case KEY_STEP:
+			ctl_printf("step %u\n", cpu->step);
+			break;
+		case KEY_POLL:
+			ctl_printf("poll %u\n", poll);
+			break;
+		default:
+			return "unknown key";
+	}
+	return NULL;
+}
+
+/*
+ * Check everything and build any new tables first, so a set either all
+ * happens or none of it does.  Setting all of them sets the command
+ * line's values too, which also keeps the load kernel's votes good for
+ * every unit and gives units that come online later the same step.
+ */
+static const char *ctl_set(int argc, char **argv)
+{
+	long val[NKEYS];
+	int have[NKEYS] = { 0 };
+	unsigned int high, low;
+	cpuinfo_t *cpu = NULL, *u, *tables = NULL;
+	int i, key, all;
+	char *end;
+
+	if ((argc < 4) || (argc % 2))
+		return "usage: set <unit>|all <key> <value>...";
+	all = (strcmp(argv[1], "all") == 0);
+	if (!all && ((cpu = ctl_unit(argv[1])) == NULL))
+		return "no such unit";
+	for (i = 2; i < argc; i += 2) {
+		if ((key = ctl_key(argv[i])) < 0)
+			return "unknown key";
+		if (key == KEY_FUNC) {
+			val[key] = ctl_func(argv[i+1]);
+		} else {
+			val[key] = strtol(argv[i+1], &end, 10);
+			if ((*argv[i+1] == '\0') || (*end != '\0'))
+				val[key] = -1;
+		}
+		have[key] = 1;
+	}
+
+	if (have[KEY_FUNC] && (val[KEY_FUNC] < 0))
+		return "func is a mode, 0 to 4 or its name";
+	if ((have[KEY_HIGHWATER] && 
+			((val[KEY_HIGHWATER] < 0) || (val[KEY_HIGHWATER] > 100))) ||
+			(have[KEY_LOWWATER] && 
+			((val[KEY_LOWWATER] < 0) || (val[KEY_LOWWATER] > 100))))
+		return "highwater and lowwater are percentages";
+	if (have[KEY_STEP] && (val[KEY_STEP] < 1))
+		return "step must be positive";
+	if (have[KEY_POLL]) {
+		if (!all)
+			return "poll is shared, it can only be set for all";
+		if (adaptive)
+			return "poll is adaptive (-a)";
+		if (val[KEY_POLL] < 1)
+			return "poll must be positive";
+		if (!window_fits(val[KEY_POLL]))
+			return "poll too short for the -w windows";
+	}
+	for (i = 0; i < nunits; i++) {
+		u = units[i];
+		if (cpu && (u != cpu))
+			continue;
+		high = have[KEY_HIGHWATER] ? val[KEY_HIGHWATER] : u->highwater;
+		low = have[KEY_LOWWATER] ? val[KEY_LOWWATER] : u->lowwater;
+		if (low > high)
+			return "lowwater would be above highwater";
+		if (have[KEY_STEP] && u->needs_init)
+			return "a unit isn't set up yet, its cpus are offline";
+	}
+	if (have[KEY_STEP]) {
+		tables = (cpuinfo_t *)malloc(nunits * sizeof(cpuinfo_t));
+		if (tables == NULL)
+			return "couldn't build the frequency tables";
+		for (i = 0; i < nunits; i++) {
+			if (cpu && (units[i] != cpu))
+				continue;
+			if (ctl_build_table(units[i], &tables[i], 
+						val[KEY_STEP]) != 0)
+				break;
+		}
+		if (i < nunits) {
+			while (i-- > 0) {
+				if (!cpu || (units[i] == cpu))
+					free(tables[i].metrics);
+			}
+			free(tables);
+			return "couldn't build the frequency tables";
+		}
+	}
+
+	if (all) {
+		if (have[KEY_FUNC])
+			func = val[KEY_FUNC];
+		if (have[KEY_HIGHWATER])
+			highwater = val[KEY_HIGHWATER];
+		if (have[KEY_LOWWATER])
+			lowwater = val[KEY_LOWWATER];
+		if (have[KEY_STEP]) {
+			step = val[KEY_STEP];
+			step_specified = 1;
+		}
+		if (have[KEY_POLL])
+			poll = val[KEY_POLL];
+	}
+	for (i = 0; i < nunits; i++) {
+		u = units[i];
+		if (cpu && (u != cpu))
+			continue;
+		if (have[KEY_FUNC])
+			u->func = val[KEY_FUNC];
+		if (have[KEY_HIGHWATER])
+			u->highwater = val[KEY_HIGHWATER];
+		if (have[KEY_LOWWATER])
+			u->lowwater = val[KEY_LOWWATER];
+		set_thresholds(u);
+		if (have[KEY_STEP])
+			ctl_retable(u, &tables[i]);
+	}
+	free(tables);
+	return NULL;
+}
+
+static const char *ctl_pause(int argc, char **argv, int paused)
+{
+	cpuinfo_t *cpu = NULL;
+	int i;
+
+	if (argc > 2)
+		return "usage: pause|resume [<unit>|all]";
+	if ((argc == 2) && (strcmp(argv[1], "all") != 0) && 
+			((cpu = ctl_unit(argv[1])) == NULL))
+		return "no such unit";
+	for (i = 0; i < nunits; i++) {
+		if (!cpu || (units[i] == cpu))
+			units[i]->paused = paused;
+	}
+	return NULL;
+}
+
+/*
+ * One line for the poll interval, then one for every unit.  Speeds are
+ * in the driver's units, load and boost in percent (load -1 if nothing
+ * ran).
+ */
+static const char *ctl_dump(int argc)
+{
+	cpuinfo_t *cpu;
+	int i;
+
+	if (argc != 1)
+		return "usage: dump";
+	ctl_printf("poll %u\n", poll);
+	for (i = 0; i < nunits; i++) {
+		cpu = units[i];
+		ctl_printf("unit %u cpus %d func %s highwater %u "
+				"lowwater %u step %u speed %lu load %d "
+				"boost %d paused %d offline %d\n", 
+				cpu->cpuid, cpu->nsiblings, 
+				str_func(cpu->func), cpu->highwater, 
+				cpu->lowwater, cpu->step, 
+				cpu->table_size ? 
+				cpu->freq_table[cpu->speed_index] : 0,
+				(cpu->pct < 0) ? -1 : (int)(cpu->pct*100 + 0.5),
+				(int)(cpu->io_boost*100 + 0.5), cpu->paused,
+				cpu->unit_offline);
+	}
+	return NULL;
+}
+
+/*
+ * What the -O file would have in it, written straight into the reply.
+ */
+static const char *ctl_metrics(int argc)
+{
+	size_t room = CTL_REPLY - ctl_reply_len;
+	FILE *f;
+	long n;
+
+	if (argc != 1)
+		return "usage: metrics";
+	f = fmemopen(ctl_reply + ctl_reply_len, room, "w");
+	if (f == NULL)
+		return "couldn't write metrics";
+	write_metrics(f);
+	fflush(f);
+	n = ftell(f);
+	/* fmemopen() wants room for a '\0' too */
+	if (ferror(f) || (n < 0) || (n + 1 >= room))
+		ctl_reply_full = 1;
+	else
+		ctl_reply_len += n;
+	fclose(f);
+	return NULL;
+}
+
+static void ctl_close(ctl_client_t *c)
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->src.fd, NULL);
+	close(c->src.fd);
+	c->src.fd = -1;
+	c->len = c->skip = 0;
+}
+
+/*
+ * Send the reply without waiting.  A client whose socket can't take all
+ * of it isn't reading, and is dropped rather than let it hold up a poll.
+ */
+static int ctl_send(ctl_client_t *c)
+{
+	size_t len = ctl_reply_len;
+	ssize_t n;
+
+	n = send(c->src.fd, ctl_reply, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	ctl_reply_len = 0;
+	ctl_reply_full = 0;
+	if (n == len)
+		return 0;
+	pprintf(2, "control: dropping a client that isn't reading\n");
+	ctl_close(c);
+	return -1;
+}
+
+static int ctl_command(ctl_client_t *c, char *line)
+{
+	char *argv[CTL_ARGS], *tok, *save;
+	const char *err;
+	int argc = 0;
+
+	for (tok = strtok_r(line, " \t\r", &save); tok && (argc < CTL_ARGS);
+			tok = strtok_r(NULL, " \t\r", &save))
+		argv[argc++] = tok;
+	if (argc == 0)
+		return 0;
+
+	pprintf(2, "control: %s\n", argv[0]);
+	if (strcmp(argv[0], "get") == 0)
+		err = ctl_get(argc, argv);
+	else if (strcmp(argv[0], "set") == 0)
+		err = ctl_set(argc, argv);
+	else if (strcmp(argv[0], "pause") == 0)
+		err = ctl_pause(argc, argv, 1);
+	else if (strcmp(argv[0], "resume") == 0)
+		err = ctl_pause(argc, argv, 0);
+	else if (strcmp(argv[0], "dump") == 0)
+		err = ctl_dump(argc);
+	else if (strcmp(argv[0], "metrics") == 0)
+		err = ctl_metrics(argc);
+	else
+		err = "unknown command";
+
+	if (ctl_reply_full) {
+		ctl_reply_len = 0;
+		ctl_reply_full = 0;
+		err = "reply too long, use -O";
+	}
+	if (err)
+		ctl_printf("error %s\n", err);
+	else
+		ctl_printf("ok\n");
+	return ctl_send(c);
+}
+
+void ctl_read(event_source_t *src)
+{
+	ctl_client_t *c = (ctl_client_t *)src;
+	char *line, *nl;
+	ssize_t n;
+
+	n = read(src->fd, c->buf + c->len, CTL_LINE - 1 - c->len);
+	if ((n < 0) && ((errno == EINTR) || (errno == EAGAIN)))
+		return;
+	if (n <= 0) {
+		ctl_close(c);
+		return;
+	}
+	c->len += n;
+	c->buf[c->len] = '\0';
+
+	line = c->buf;
+	while ((nl = strchr(line, '\n')) != NULL) {
+		*nl = '\0';
+		/* a client that got dropped is done with */
+		if (!c->skip && (ctl_command(c, line) != 0))
+			return;
+		c->skip = 0;
+		line = nl + 1;
+	}
+	c->len -= line - c->buf;
+	memmove(c->buf, line, c->len);
+	if (c->len == CTL_LINE - 1) {
+		c->len = 0;
+		if (!c->skip) {
+			ctl_printf("error line too long\n");
+			if (ctl_send(c) != 0)
+				return;
+		}
+		c->skip = 1;
+	}
+}
+
+/*
+ * Clients never get waited on: their sockets don't block, and are asked
+ * for room for a whole reply (the kernel may give less), so one that
+ * reads what it's sent gets all of it and one that doesn't is dropped.
+ */
+void ctl_accept(event_source_t *src)
+{
+	static const char busy[] = "error too many clients\n";
+	int fd, i, size = CTL_REPLY;
+
+	if ((fd = accept(src->fd, NULL, NULL)) < 0)
+		return;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	for (i = 0; (i < CTL_CLIENTS) && (ctl_clients[i].src.fd >= 0); i++);
+	if (i == CTL_CLIENTS) {
+		send(fd, busy, sizeof(busy) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+		close(fd);
+		return;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	ctl_clients[i].len = ctl_clients[i].skip = 0;
+	if (add_event_source(&ctl_clients[i].src, fd, EPOLLIN, 
+				&ctl_read) != 0) {
+		close(fd);
+		ctl_clients[i].src.fd = -1;
+	}
+}
+
+/*
+ * Create the control socket, only usable by root (or whoever we run as).
+ * A socket left behind by a daemon that didn't exit cleanly is replaced,
+ * one a live daemon is answering on isn't.
+ */
+int setup_control(void)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	mode_t mask;
+	int fd, err, i;
+
+	for (i = 0; i < CTL_CLIENTS; i++)
+		ctl_clients[i].src.fd = -1;
+	if ((ctl_reply = (char *)malloc(CTL_REPLY)) == NULL) {
+		perror("Couldn't allocate control reply");
+		return ENOMEM;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(ctl_path) >= sizeof(addr.sun_path)) {
+		printf("control socket path too long\n");
+		return ENAMETOOLONG;
+	}
+	strcpy(addr.sun_path, ctl_path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 
+					0)) < 0) {
+		err = errno;
+		perror("Couldn't create control socket");
+		return err;
+	}
+	if ((lstat(ctl_path, &st) == 0) && S_ISSOCK(st.st_mode)) {
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+			printf("%s: another daemon is listening on it\n", 
+					ctl_path);
+			close(fd);
+			return EADDRINUSE;
+		}
+		unlink(ctl_path);
+	}
+
+	/* clients that go away mid-reply mustn't kill us */
+	signal(SIGPIPE, SIG_IGN);
+	mask = umask(077);
+	if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+			(listen(fd, CTL_CLIENTS) < 0)) {
+		err = errno;
+		umask(mask);
+		perror(ctl_path);
+		close(fd);
+		return err;
+	}
+	umask(mask);
+	return add_event_source(&ctl_src, fd, EPOLLIN, &ctl_accept);
+}
+
+/*
+ * Counters for a unit that has just got its freq_table (again: a new
+ * table means new states, so they start over).
+ */
+int alloc_metrics(cpuinfo_t *cpu)
+{
+	unit_metrics_t *m;
+	unsigned int n = cpu->table_size;
+	size_t size;
+
+	if (!metrics_path && !ctl_path)
+		return 0;
+	size = sizeof(unit_metrics_t) + n * sizeof(unsigned long long);
+	if (n <= TRANS_STATES)
+		size += n * n * sizeof(unsigned int);
+	free(cpu->metrics);
+	if ((m = (unit_metrics_t *)calloc(1, size)) == NULL) {
+		cpu->metrics = NULL;
+		perror("Couldn't malloc metrics");
+		return ENOMEM;
+	}
+	m->states = n;
+	m->index = cpu->speed_index;
+	m->time_ms = (unsigned long long *)(m + 1);
+	if (n <= TRANS_STATES)
+		m->trans = (unsigned int *)(m->time_ms + n);
+	cpu->metrics = m;
+	return 0;
+}
+
+static unsigned long unit_khz(cpuinfo_t *cpu, unsigned int index)
+{
+	return cpu->freq_table[index] * (cpu->in_mhz ? 1000 : 1);
+}
+
+/*
+ * Everything, in Prometheus's text format.  Non-zero if f went bad.
+ */
+int write_metrics(FILE *f)
+{
+	unit_metrics_t *m;
+	unsigned long long count;
+	cpuinfo_t *cpu;
+	unsigned int i, from, to;
+	int u;
+
+	fprintf(f, "# HELP powernowd_unit_speed_khz Speed each scalable "
+			"unit is at.\n"
+			"# TYPE powernowd_unit_speed_khz gauge\n");
+	for (u = 0; u < nunits; u++) {
+		cpu = units[u];
+		if (cpu->metrics && !cpu->unit_offline)
+			fprintf(f, "powernowd_unit_speed_khz{unit=\"%u\"} "
+					"%lu\n", cpu->cpuid, 
+					unit_khz(cpu, cpu->speed_index));
+	}
+
+	fprintf(f, "# HELP powernowd_unit_time_seconds_total Time each "
+			"scalable unit spent at each speed, while online.\n"
+			"# TYPE powernowd_unit_time_seconds_total counter\n");
+	for (u = 0; u < nunits; u++) {
+		cpu = units[u];
+		if ((m = cpu->metrics) == NULL)
+			continue;
+		for (i = 0; i < m->states; i++)
+			fprintf(f, "powernowd_unit_time_seconds_total"
+					"{unit=\"%u\",khz=\"%lu\"} %.3f\n", 
+					cpu->cpuid, unit_khz(cpu, i), 
+					m->time_ms[i] / 1000.0);
+	}
+
+	fprintf(f, "# HELP powernowd_unit_changes_total Speed changes of "
+			"each scalable unit, up or down.\n"
+			"# TYPE powernowd_unit_changes_total counter\n");
+	for (u = 0; u < nunits; u++) {
+		cpu = units[u];
+		if ((m = cpu->metrics) == NULL)
+			continue;
+		fprintf(f, "powernowd_unit_changes_total{unit=\"%u\","
+				"direction=\"up\"} %llu\n"
+				"powernowd_unit_changes_total{unit=\"%u\","
+				"direction=\"down\"} %llu\n", 
+				cpu->cpuid, m->up, cpu->cpuid, m->down);
+	}
+
+	fprintf(f, "# HELP powernowd_unit_transitions_total Speed changes "
+			"of each scalable unit, by from and to speed (only "
+			"those seen, and only for tables of up to %d speeds).\n"
+			"# TYPE powernowd_unit_transitions_total counter\n",
+			TRANS_STATES);
+	for (u = 0; u < nunits; u++) {
+		cpu = units[u];
+		if (((m = cpu->metrics) == NULL) || (m->trans == NULL))
+			continue;
+		for (from = 0; from < m->states; from++) {
+			for (to = 0; to < m->states; to++) {
+				if (m->trans[from * m->states + to] == 0)
+					continue;
+				fprintf(f, "powernowd_unit_transitions_total"
+						"{unit=\"%u\",from=\"%lu\","
+						"to=\"%lu\"} %u\n", cpu->cpuid, 
+						unit_khz(cpu, from), 
+						unit_khz(cpu, to),
+						m->trans[from * m->states + to]);
+			}
+		}
+	}
+
+	fprintf(f, "# HELP powernowd_unit_load Load of each scalable unit's "
+			"busiest cpu, each poll.\n"
+			"# TYPE powernowd_unit_load histogram\n");
+	for (u = 0; u < nunits; u++) {
+		cpu = units[u];
+		if ((m = cpu->metrics) == NULL)
+			continue;
+		for (i = 0, count = 0; i < LOAD_BUCKETS; i++) {
+			count += m->load[i];
+			fprintf(f, "powernowd_unit_load_bucket{unit=\"%u\","
+					"le=\"%.1f\"} %llu\n", cpu->cpuid,
+					(i + 1.0) / LOAD_BUCKETS, count);
+		}
+		count += m->load[LOAD_BUCKETS];
+		fprintf(f, "powernowd_unit_load_bucket{unit=\"%u\","
+				"le=\"+Inf\"} %llu\n"
+				"powernowd_unit_load_sum{unit=\"%u\"} %.3f\n"
+				"powernowd_unit_load_count{unit=\"%u\"} %llu\n",
+				cpu->cpuid, count, cpu->cpuid, m->load_sum,
+				cpu->cpuid, count);
+	}
+
+	fprintf(f, "# HELP powernowd_poll_seconds Time taken by each poll.\n"
+			"# TYPE powernowd_poll_seconds histogram\n");
+	for (i = 0, count = 0; i < TICK_BUCKETS; i++) {
+		count += tick_hist[i];
+		fprintf(f, "powernowd_poll_seconds_bucket{le=\"%g\"} %llu\n",
+				tick_le[i], count);
+	}
+	count += tick_hist[TICK_BUCKETS];
+	fprintf(f, "powernowd_poll_seconds_bucket{le=\"+Inf\"} %llu\n"
+			"powernowd_poll_seconds_sum %.6f\n"
+			"powernowd_poll_seconds_count %llu\n", 
+			count, tick_sum, count);
+	return ferror(f);
+}
+
+/*
+ * Rewrite the -O file: write it all to file.tmp and rename that over it,
+ * so whoever reads it never sees half of it.
+ */
+int save_metrics(void)
+{
+	char tmp[PATH_MAX];
+	FILE *f;
+	int err;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", metrics_path);
+	if ((f = fopen(tmp, "we")) == NULL) {
+		err = errno;
+		perror(tmp);
+		return err;
+	}
+	err = write_metrics(f);
+	if (fclose(f) || err) {
+		err = errno ? errno : EIO;
+		perror(tmp);
+		unlink(tmp);
+		return err;
+	}
+	if (rename(tmp, metrics_path) < 0) {
+		err = errno;
+		perror(metrics_path);
+		unlink(tmp);
+		return err;
+	}
+	return 0;
+}
+
+void metrics_event(event_source_t *src)
+{
+	uint64_t expirations;
+
+	if (read(src->fd, &expirations, sizeof(expirations)) < 0)
+		return;
+	save_metrics();
+}
+
+/*
+ * The -O file is rewritten on its own timer, not by the poll.
+ */
+int setup_metrics(void)
+{
+	struct itimerspec its;
+	int fd, err;
+
+	if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0) {
+		err = errno;
+		perror("timerfd_create");
+		return err;
+	}
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = its.it_interval.tv_sec = METRICS_SECS;
+	if (timerfd_settime(fd, 0, &its, NULL) < 0) {
+		err = errno;
+		perror("Couldn't arm metrics timer");
+		close(fd);
+		return err;
+	}
+	if ((err = add_event_source(&metrics_src, fd, EPOLLIN, 
+					&metrics_event)) != 0)
+		return err;
+	return save_metrics();
+}
+
+/*
+ * Create the -D file and map the ring.  Its blocks are allocated and its
+ * pages touched now, so recording never faults (or, out of disk space,
+ * dies of SIGBUS) later.  Best kept on a tmpfs like /run.
+ */
+int setup_trace(void)
+{
+	size_t size = sizeof(trace_header_t) + 
+		TRACE_RECORDS * sizeof(trace_record_t);
+	void *p;
+	int fd, err;
+
+	if ((fd = open(trace_path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 
+					0600)) < 0) {
+		err = errno;
+		perror(trace_path);
+		return err;
+	}
+	if ((err = posix_fallocate(fd, 0, size)) != 0) {
+		errno = err;
+		perror(trace_path);
+		close(fd);
+		return err;
+	}
+	p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		err = errno;
+		perror("Couldn't map the decision trace");
+		return err;
+	}
+	memset(p, 0, size);
+	trace_ring = (trace_header_t *)p;
+	trace_recs = (trace_record_t *)(trace_ring + 1);
+	memcpy(trace_ring->magic, TRACE_MAGIC, sizeof(trace_ring->magic));
+	trace_ring->version = TRACE_VERSION;
+	trace_ring->record_size = sizeof(trace_record_t);
+	trace_ring->records = TRACE_RECORDS;
+	trace_ring->clk_tck = clk_tck;
+	return 0;
+}
+
+/*
+ * -X: write the decision trace in decode_path out as CSV, oldest first.
+ * Works on a live ring too, records overwritten as we go are left out.
+ */
+int decode_trace(void)
+{
+	static const char *changes[] = { "LOWER", "SAME", "RAISE" };
+	const trace_header_t *hdr;
+	const trace_record_t *recs;
+	trace_record_t r;
+	char flags[32], pct[16];
+	int change;
+	struct stat st;
+	uint64_t n, head, now;
+	void *p;
+	int fd, err;
+
+	if ((fd = open(decode_path, O_RDONLY)) < 0) {
+		err = errno;
+		perror(decode_path);
+		return err;
+	}
+	if (fstat(fd, &st) < 0) {
+		err = errno;
+		perror(decode_path);
+		close(fd);
+		return err;
+	}
+	if (st.st_size < sizeof(trace_header_t)) {
+		printf("%s: not a decision trace\n", decode_path);
+		close(fd);
+		return EINVAL;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		err = errno;
+		perror(decode_path);
+		return err;
+	}
+	hdr = (const trace_header_t *)p;
+	recs = (const trace_record_t *)(hdr + 1);
+	if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) || 
+			(hdr->version != TRACE_VERSION) ||
+			(hdr->record_size != sizeof(trace_record_t)) ||
+			(hdr->records == 0) ||
+			(st.st_size < sizeof(trace_header_t) + 
+			 hdr->records * sizeof(trace_record_t))) {
+		printf("%s: not a version %d decision trace\n", decode_path,
+				TRACE_VERSION);
+		munmap(p, st.st_size);
+		return EINVAL;
+	}
+
+	printf("ns,unit,cpu,pct,change,func,flags,old_mhz,new_mhz,"
+			"user,nice,system,idle,iowait,steal\n");
+	head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	for (n = (head > hdr->records) ? head - hdr->records : 0; 
+			n < head; n++) {
+		r = recs[n % hdr->records];
+		/* if the daemon's still going, it may have been overwritten */
+		now = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+		if ((now != head) && (now >= n + hdr->records))
+			continue;
+		change = r.change & TR_CHANGE;
+		flags[0] = '\0';
+		if (r.change & TR_HELD)
+			strcat(flags, " held");
+		if (r.change & TR_PAUSED)
+			strcat(flags, " paused");
+		if (r.change & TR_PRESSURE)
+			strcat(flags, " pressure");
+		if (r.pct == TR_NO_PCT)
+			strcpy(pct, "-1");
+		else
+			snprintf(pct, sizeof(pct), "%.4f", r.pct / 10000.0);
+		printf("%llu,%u,%u,%s,%s,%s,%s,%u,%u,%u,%u,%u,%u,%u,%u\n",
+				(unsigned long long)r.ns, r.unit, r.cpu, pct, 
+				(change <= RAISE) ? changes[change] : "?",
+				(r.func < NFUNCS) ? str_func(r.func) : "?",
+				flags + (flags[0] != '\0'),
+				r.old_mhz, r.new_mhz, 
+				r.delta[TD_USER], r.delta[TD_NICE],
+				r.delta[TD_SYSTEM], r.delta[TD_IDLE], 
+				r.delta[TD_IOWAIT], r.delta[TD_STEAL]);
+	}
+	munmap(p, st.st_size);
+	return 0;
+}
+
+/*
+ * Number of cpus to manage: everything in the "possible" mask ("0-3,8-11"
+ * style), which covers any cpu that can ever be plugged in.  If it isn't
+ * there, glibc's count will have to do.
+ */
+int count_cpus(void)
+{
+	char filename[PATH_MAX], *p1;
+	int n, last = -1;
+
+	snprintf(filename, sizeof(filename), "%spossible", sysfs_tree);
+	if (read_file(filename, 0, 1) != 0)
+		return (root_dir == NULL) ? sysconf(_SC_NPROCESSORS_CONF) : -1;
+
+	p1 = buf;
+	while (*p1 != '\0' && *p1 != '\n') {
+		n = strtol(p1, &p1, 10);
+		if (*p1 == '-')
+			n = strtol(p1+1, &p1, 10);
+		if (n > last)
+			last = n;
+		if (*p1 == ',')
+			p1++;
+		else
+			break;
+	}
+	return last+1;
+}
+
+/*
+ * Fake cpufreq tree.  Builds just enough of sysfs and /proc under root_dir
+ * for the daemon to start up and run on cpus that don't exist, so it can be
+ * tested and benchmarked by a normal user.  The cpus are split into
+ * policies of t_per_core, numbered the way servers number hyperthreads:
+ * with 8 cpus and -c 2, policy0 is cpus 0 and 4, policy1 is 1 and 5...
+ * Every policy gets the same table of FAKE_MIN_FREQ..FAKE_MAX_FREQ in
+ * FAKE_FREQ_STEP steps and the userspace governor.  With -G #m every
+ * frequency is written in MHz instead, like longhaul and friends do.
+ */
+#define FAKE_MAX_FREQ	3000000
+#define FAKE_MIN_FREQ	1000000
+#define FAKE_FREQ_STEP	250000
+
+static cpustats_t *fake_stats = NULL;
+
+/* mkdir -p */
+static int make_dirs(char *path)
+{
+	char *p1;
+	int err;
+
+	for (p1 = path + 1; ; p1++) {
+		if (*p1 != '/' && *p1 != '\0')
+			continue;
+		char save = *p1;
+		*p1 = '\0';
+		if ((mkdir(path, 0755) < 0) && (errno != EEXIST)) {
+			err = errno;
+			perror(path);
+			*p1 = save;
+			return err;
 		}
-	
-		cpu->freq_table = (unsigned long *)
-			malloc(cpu->table_size*sizeof(unsigned long));
-		if (cpu->freq_table == (unsigned long *)NULL) {
-			perror("Couldn't allocate cpu->freq_table\n");
+		*p1 = save;
+		if (save == '\0')
+			break;
+	}
+	return 0;
+}
+
+static int put_file(const char *dir, const char *name, const char *fmt, ...)
+{
+	char filename[PATH_MAX];
+	va_list ap;
+	FILE *fp;
+	int err;
+
+	snprintf(filename, sizeof(filename), "%s%s", dir, name);
+	if ((fp = fopen(filename, "w")) == NULL) {
+		err = errno;
+		perror(filename);
+		return err;
+	}
+	va_start(ap, fmt);
+	vfprintf(fp, fmt, ap);
+	va_end(ap);
+	if (fclose(fp) != 0) {
+		err = errno;
+		perror(filename);
+		return err;
+	}
+	return 0;
+}
+
+/*
+ * Rewrite the fake /proc/stat for the given tick.  This is the "script":
+ * each cpu's load is a triangle wave between 0 and 100% over 20 ticks, and
+ * each tick is worth "jiffies" of time.  The cpus of a unit move together
+ * and out of phase with the other units, as a unit only slows down once
+ * its busiest cpu does; once the daemon has found the units (-B) a cpu's
+ * phase is its unit's lead cpu.
+ * The counters start off about where a box that's been up for a few weeks
+ * would have them, so the lines are as long as real ones.  Written in
+ * place so an already open stat_fd sees the new contents.
+ */
+static void print_stats(FILE *fp, const char *name, cpustats_t *s)
+{
+	fprintf(fp, "%s %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu\n", 
+			name, s->user, s->mynice, s->system, s->idle, 
+			s->iowait, s->irq, s->softirq, s->steal, s->guest, 
+			s->guest_nice);
+}
+
+int fake_write_stat(unsigned int tick, unsigned int jiffies)
+{
+	FILE *fp;
+	cpustats_t total;
+	unsigned int i, unit, phase, busy;
+	char name[16];
+	int err;
+
+	if (fake_stats == NULL) {
+		fake_stats = (cpustats_t *)calloc(fake_cpus, sizeof(cpustats_t));
+		if (fake_stats == NULL) {
+			perror("Couldn't allocate fake stats");
 			return ENOMEM;
 		}
-	
-		p1 = buf;
-		for (temp = 0; temp < cpu->table_size; temp++) {
-			cpu->freq_table[temp] = strtoul(p1, &p1, 10);
+		for (i = 0; i < fake_cpus; i++) {
+			fake_stats[i].user = 31415926 + (i * 2718);
+			fake_stats[i].mynice = 27182 + i;
+			fake_stats[i].system = 8675309 + (i * 1414);
+			fake_stats[i].idle = 186282397 + (i * 1732);
+			fake_stats[i].iowait = 299792 + (i * 17);
+			fake_stats[i].softirq = 1618033 + (i * 31);
 		}
 	}
 
-	/* now lets sort the table just to be sure */
-	qsort(cpu->freq_table, cpu->table_size, sizeof(unsigned long), 
-			&faked_compare);
-	
-	strncpy(scratch, cpu->sysfs_dir, 50);
-	strncat(scratch, "scaling_governor", 20);
+	memset(&total, 0, sizeof(cpustats_t));
+	for (i = 0; i < fake_cpus; i++) {
+		unit = i;
+		if (all_cpus && (i < ncpus) && (all_cpus[i]->scalable_unit >= 0))
+			unit = all_cpus[i]->scalable_unit;
+		phase = (tick + unit) % 20;
+		busy = ((phase < 10) ? phase : (20 - phase)) * jiffies / 10;
+		fake_stats[i].user += busy - busy/4;
+		fake_stats[i].system += busy/4;
+		fake_stats[i].idle += jiffies - busy;
+		total.user += fake_stats[i].user;
+		total.mynice += fake_stats[i].mynice;
+		total.system += fake_stats[i].system;
+		total.idle += fake_stats[i].idle;
+		total.iowait += fake_stats[i].iowait;
+		total.softirq += fake_stats[i].softirq;
+	}
 
-	if ((err = read_file(scratch, 0, 1)) != 0) {
-		perror("couldn't open scaling_governors file");
+	if ((fp = fopen(proc_stat, "w")) == NULL) {
+		err = errno;
+		perror(proc_stat);
+		return err;
+	}
+	print_stats(fp, "cpu ", &total);
+	for (i = 0; i < fake_cpus; i++) {
+		snprintf(name, sizeof(name), "cpu%u", i);
+		print_stats(fp, name, &fake_stats[i]);
+	}
+	fprintf(fp, "intr 0\nctxt 0\nbtime 0\nprocesses 0\n"
+			"procs_running 1\nprocs_blocked 0\nsoftirq 0\n");
+	if (fclose(fp) != 0) {
+		err = errno;
+		perror(proc_stat);
 		return err;
 	}
+	return 0;
+}
 
-	if (strncmp(buf, "userspace", 9) != 0) {
-		if ((fd = open(scratch, O_RDWR)) < 0) {
-			err = errno;
-			perror("couldn't open govn's file for writing");
+int make_fake_tree(void)
+{
+	char dir[PATH_MAX], link[64], freqs[1024], *siblings;
+	unsigned int i, j, len, npolicies;
+	unsigned long f;
+	int err = 0;
+
+	snprintf(dir, sizeof(dir), "%s", sysfs_tree);
+	if ((err = make_dirs(dir)) != 0)
+		return err;
+	for (i = 0; i < 3; i++) {
+		if ((err = put_file(sysfs_tree, 
+				(i == 0) ? "possible" : (i == 1) ? "present" : 
+				"online", "0-%u\n", fake_cpus-1)) != 0)
 			return err;
-		}
-		strncpy(tmp, "userspace\n", 11);
-		if (write(fd, tmp, 11*sizeof(char)) < 0) {
+	}
+
+	len = 0;
+	for (f = FAKE_MAX_FREQ; f >= FAKE_MIN_FREQ; f -= FAKE_FREQ_STEP)
+		len += snprintf(freqs+len, sizeof(freqs)-len, "%lu ", 
+				f / fake_unit);
+
+	npolicies = (fake_cpus + t_per_core - 1) / t_per_core;
+	if ((siblings = (char *)malloc(t_per_core * 12 + 1)) == NULL) {
+		perror("Couldn't allocate sibling list");
+		return ENOMEM;
+	}
+	for (i = 0; i < npolicies; i++) {
+		len = 0;
+		for (j = i; j < fake_cpus; j += npolicies)
+			len += sprintf(siblings+len, "%u ", j);
+
+		snprintf(dir, sizeof(dir), "%scpufreq/policy%u/", sysfs_tree, i);
+		if ((err = make_dirs(dir)) != 0)
+			break;
+		if ((err = put_file(dir, "cpuinfo_max_freq", "%u\n", 
+						FAKE_MAX_FREQ / fake_unit)) ||
+		    (err = put_file(dir, "cpuinfo_min_freq", "%u\n", 
+			    			FAKE_MIN_FREQ / fake_unit)) ||
+		    (err = put_file(dir, "cpuinfo_transition_latency", 
+			    			"10000\n")) ||
+		    (err = put_file(dir, "scaling_max_freq", "%u\n", 
+			    			FAKE_MAX_FREQ / fake_unit)) ||
+		    (err = put_file(dir, "scaling_min_freq", "%u\n", 
+			    			FAKE_MIN_FREQ / fake_unit)) ||
+		    (err = put_file(dir, "scaling_setspeed", "%u\n", 
+			    			FAKE_MAX_FREQ / fake_unit)) ||
+		    (err = put_file(dir, "scaling_available_frequencies", 
+			    			"%s\n", freqs)) ||
+		    (err = put_file(dir, "scaling_governor", "userspace\n")) ||
+		    (err = put_file(dir, "affected_cpus", "%s\n", siblings)) ||
+		    (err = put_file(dir, "related_cpus", "%s\n", siblings)))
+			break;
+
+		/* the fake hardware always runs at the speed it was given */
+		strcat(dir, "scaling_cur_freq");
+		if ((symlink("scaling_setspeed", dir) < 0) && 
+				(errno != EEXIST)) {
 			err = errno;
-			perror("Error writing file governor");
-			close(fd);
-			return err;
+			perror(dir);
+			break;
 		}
-		if ((err = read_file(scratch, fd, 0)) != 0) {
-			perror("Error reading back governor file");
-			close(fd);
-			return err;
+
+		/* and cpuN/cpufreq points at the policy, like the real thing */
+		for (j = i; j < fake_cpus; j += npolicies) {
+			snprintf(dir, sizeof(dir), "%scpu%u", sysfs_tree, j);
+			if ((err = make_dirs(dir)) != 0)
+				break;
+			snprintf(dir, sizeof(dir), "%scpu%u/cpufreq", 
+					sysfs_tree, j);
+			snprintf(link, sizeof(link), "../cpufreq/policy%u", i);
+			if ((symlink(link, dir) < 0) && (errno != EEXIST)) {
+				err = errno;
+				perror(dir);
+				break;
+			}
 		}
-		close(fd);
-		if (strncmp(buf, "userspace", 9) != 0) {
-			perror("Can't set to userspace governor, exiting");
-			return EPIPE;
+		if (err)
+			break;
+	}
+	free(siblings);
+	if (err)
+		return err;
+
+	snprintf(dir, sizeof(dir), "%s", proc_stat);
+	*strrchr(dir, '/') = '\0';
+	if ((err = make_dirs(dir)) != 0)
+		return err;
+
+	/* and one for cpu uevents, write to it after changing "online" */
+	snprintf(dir, sizeof(dir), "%suevent", sysfs_tree);
+	if ((mkfifo(dir, 0644) < 0) && (errno != EEXIST)) {
+		err = errno;
+		perror(dir);
+		return err;
+	}
+
+	/* a fifo stands in for the pressure trigger, write to it to fire */
+	snprintf(dir, sizeof(dir), "%s", proc_pressure);
+	*strrchr(dir, '/') = '\0';
+	if ((err = make_dirs(dir)) != 0)
+		return err;
+	if ((mkfifo(proc_pressure, 0644) < 0) && (errno != EEXIST)) {
+		err = errno;
+		perror(proc_pressure);
+		return err;
+	}
+	return fake_write_stat(0, 100);
+}
+
+/*
+ * Time the load and vote kernels alone, on the current snapshot, a
+ * thousand times over.  Returns ns per pass over all the cpus.
+ */
+#define KERNEL_PASSES 1000
+
+double bench_kernel(int scalar)
+{
+	struct timespec t0, t1;
+	int i;
+
+	scalar_kernel = scalar;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < KERNEL_PASSES; i++) {
+		load_kernel();
+		vote_kernel();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	scalar_kernel = 0;
+	return (double)(ts_ns(&t1) - ts_ns(&t0)) / KERNEL_PASSES;
+}
+
+/*
+ * parse_stat() the way it used to be done, with a strtoll() per number,
+ * kept to measure the real one against.  Fills in the same counters, but
+ * doesn't look out for counters going backwards.
+ */
+static int parse_stat_libc(char *p, char *end)
+{
+	unsigned long long *tmp;
+	unsigned int id;
+	int col, found = 0;
+
+	for (col = 0; col < NSTAT; col++) {
+		tmp = stat_last[col];
+		stat_last[col] = stat_now[col];
+		stat_now[col] = tmp;
+	}
+
+	while ((p = memchr(p, '\n', end - p)) != NULL) {
+		p++;
+		if (((end - p) < 3) || (strncmp(p, "cpu", 3) != 0))
+			break;
+		if (memchr(p, '\n', end - p) == NULL)
+			break;
+		if ((p[3] < '0') || (p[3] > '9'))
+			continue;
+		id = strtoul(p+3, &p, 10);
+		if (id >= ncpus)
+			continue;
+		for (col = 0; col < NSTAT; col++)
+			stat_now[col][id] = strtoll(p, &p, 10);
+		found++;
+	}
+	return found ? 0 : ENOENT;
+}
+
+/*
+ * Parse the /proc/stat snapshot in statbuf PARSE_PASSES times over, with
+ * parse_stat() or the strtoll() version, and return MB/s.
+ */
+#define PARSE_PASSES 200
+
+double bench_parse(int libc)
+{
+	struct timespec t0, t1;
+	char *end = statbuf + statbuf_len;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < PARSE_PASSES; i++) {
+		if (libc)
+			parse_stat_libc(statbuf, end);
+		else
+			parse_stat(statbuf, end);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (double)statbuf_len * PARSE_PASSES * 1000.0 / 
+		(ts_ns(&t1) - ts_ns(&t0));
+}
+
+/*
+ * -B: run bench_ticks polls back to back against a fake tree, advancing
+ * its scripted /proc/stat by one poll interval (at HZ=100) before each
+ * one, and report what the sampling (get_stat/decide_speed) and the
+ * actuation (change_speed) halves of a poll cost us.  The script rewrite
+ * isn't counted.  The polls run on the script's clock too, each one poll
+ * interval after the last, so -M and -b see the time the script says has
+ * gone by rather than the few usecs the bench took.  Then compare the
+ * vector and scalar load kernels, and parse_stat() with the strtoll()
+ * parser it replaced.
+ */
+int bench(void)
+{
+	struct timespec t0, t1, t2;
+	unsigned long long sample_ns = 0, actuate_ns = 0;
+	double scalar_ns, parse_mbs, libc_mbs, lines = 0;
+	char *p;
+	unsigned long long calls0, bytes0, start_ms, raises = 0, lowers = 0;
+	unsigned int tick, jiffies, *was;
+	int i, err;
+
+	jiffies = (poll >= 10) ? (poll / 10) : 1;
+	fake_cpus = ncpus;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	start_ms = ts_ns(&t0) / 1000000;
+
+	/* line the script up with whatever is in the tree already */
+	if ((err = fake_write_stat(0, jiffies)) != 0 || 
+			(err = get_stat()) != 0)
+		return err;
+
+	if ((was = (unsigned int *)malloc(nunits * sizeof(*was))) == NULL) {
+		perror("Couldn't allocate bench speeds");
+		return ENOMEM;
+	}
+	calls0 = io_syscalls;
+	bytes0 = io_bytes_read;
+	for (tick = 1; tick <= bench_ticks; tick++) {
+		if ((err = fake_write_stat(tick, jiffies)) != 0)
+			goto out;
+		for (i = 0; i < nunits; i++)
+			was[i] = units[i]->speed_index;
+		/* sample_all(), but on the script's clock */
+		now_ms = start_ms + (unsigned long long)tick * poll;
+		now_ns = now_ms * 1000000;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if ((err = get_stat()) != 0)
+			goto out;
+		decide_all();
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		actuate_all();
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		sample_ns += ts_ns(&t1) - ts_ns(&t0);
+		actuate_ns += ts_ns(&t2) - ts_ns(&t1);
+		for (i = 0; i < nunits; i++) {
+			/* the table runs from fastest to slowest */
+			if (units[i]->speed_index < was[i])
+				raises++;
+			else if (units[i]->speed_index > was[i])
+				lowers++;
 		}
 	}
-	
-	cpu->last_reading = (cpustats_t *)malloc(sizeof(cpustats_t));
-	cpu->reading = (cpustats_t *)malloc(sizeof(cpustats_t));
-	memset(cpu->last_reading, 0, sizeof(cpustats_t));
-	memset(cpu->reading, 0, sizeof(cpustats_t));
-	
-	/*
-	 * Some cpufreq drivers (longhaul) report speeds in MHz instead
-	 * of KHz.  Assume for now that any currently supported cpufreq 
-	 * processor will a) not be faster then 10GHz, and b) not be slower
-	 * then 10MHz. Therefore, is the number for max_speed is less than
-	 * 10000, assume the driver is reporting speeds in MHz, not KHz,
-	 * and adjust accordingly.
-	 *
-	 * XXXjc the longhaul driver has been fixed (2.6.5ish timeframe)
-	 * so this should't be needed anymore.  Remove for 1.0?
+	free(was);
+
+	printf("cpus %5d  poll %5d ms: %10.0f ns/tick (sample %10.0f, "
+			"actuate %9.0f), %7.1f syscalls/tick, "
+			"%9.0f bytes read/tick, %6.2f raises %6.2f lowers/tick\n",
+			ncpus, poll,
+			(double)(sample_ns + actuate_ns) / bench_ticks,
+			(double)sample_ns / bench_ticks,
+			(double)actuate_ns / bench_ticks,
+			(double)(io_syscalls - calls0) / bench_ticks,
+			(double)(io_bytes_read - bytes0) / bench_ticks,
+			(double)raises / bench_ticks,
+			(double)lowers / bench_ticks);
+	/* a poll that never changes a speed isn't benching the actuation */
+	if ((raises == 0) || (lowers == 0)) {
+		printf("the script made no %s, try more ticks\n",
+				(raises == 0) ? "raises" : "lowers");
+		return EINVAL;
+	}
+
+	scalar_ns = bench_kernel(1);
+#ifdef HAVE_VECTOR
+	double vector_ns = bench_kernel(0);
+
+	printf("cpus %5d  load kernel: %10.0f ns/pass vector, %10.0f scalar, "
+			"%5.2fx\n", ncpus, vector_ns, scalar_ns, 
+			scalar_ns / vector_ns);
+#else
+	printf("cpus %5d  load kernel: %10.0f ns/pass (scalar only)\n", 
+			ncpus, scalar_ns);
+#endif
+
+	for (p = statbuf; (p = memchr(p, '\n', statbuf + statbuf_len - p)); 
+			p++)
+		lines++;
+	libc_mbs = bench_parse(1);
+	parse_mbs = bench_parse(0);
+	/* MB/s over bytes per line is lines per usec */
+	printf("cpus %5d  /proc/stat parse: %7.1f MB/s %6.2f Mlines/s, "
+			"strtoll %7.1f MB/s %6.2f Mlines/s, %5.2fx\n", ncpus,
+			parse_mbs, parse_mbs * lines / statbuf_len, 
+			libc_mbs, libc_mbs * lines / statbuf_len, 
+			parse_mbs / libc_mbs);
+	return 0;
+out:
+	free(was);
+	return err;
+}
+
+/*
+ * Trace driven simulator (-S).  A trace is a series of /proc/stat snapshots,
+ * each headed by a "# time <msecs>" line, with the frequency table of the
+ * cpus given once on a "# freqs <kHz> <kHz> ..." line.  See the README for
+ * how to record one.  The trace is run through the same decide_speed() and
+ * change_speed() logic as the daemon, at -p intervals, for each mode in
+ * turn, with writes to sysfs turned off.
+ */
+typedef struct snapshot {
+	unsigned long long time; /* msecs */
+	char *start;
+	char *end;
+} snapshot_t;
+
+typedef struct trace {
+	char *data;
+	size_t size;
+	char *freqs;
+	snapshot_t *snaps;
+	unsigned int nsnaps;
+	int ncpus;
+	/* 
+	 * Busiest cpu's load (%) in each unit over the interval ending at
+	 * each snapshot, at the trace's own resolution, nsnaps*nunits.
 	 */
-	cpu->in_mhz = 0;
-	if (cpu->max_speed <= 10000) {
-		cpu->in_mhz = 1;
-		cpu->max_speed *= 1000;
-		cpu->min_speed *= 1000;
-		cpu->current_speed *= 1000;
+	unsigned char *load;
+} trace_t;
+
+typedef struct sim_result {
+	unsigned int transitions;
+	unsigned long long duration; /* msecs, summed over all units */
+	/* time a unit was below max speed with a cpu at/over sim_highwater */
+	unsigned long long underprov;
+	double energy; /* kHz*msecs, summed over all units */
+	unsigned long long *time_in_state; /* msecs, per freq_table entry */
+	unsigned int tis_size;
+} sim_result_t;
+
+/* the highwater used to judge under-provisioning, whatever is simulated */
+unsigned int sim_highwater = 80;
+
+/*
+ * Map the trace and find the snapshots in it.
+ */
+int load_trace(const char *file, trace_t *t)
+{
+	struct stat st;
+	char *p, *end, *nl;
+	unsigned int size = 0, id;
+	int fd, err;
+
+	memset(t, 0, sizeof(trace_t));
+	if ((fd = open(file, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		err = errno;
+		perror(file);
+		return err;
+	}
+	t->size = st.st_size;
+	t->data = mmap(NULL, t->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (t->data == MAP_FAILED) {
+		err = errno;
+		perror(file);
+		return err;
+	}
+	madvise(t->data, t->size, MADV_SEQUENTIAL);
+
+	end = t->data + t->size;
+	for (p = t->data; p < end; p = nl + 1) {
+		if ((nl = memchr(p, '\n', end - p)) == NULL)
+			nl = end;
+		/* parse_stat() wants every line's newline in the snapshot */
+		if (t->nsnaps > 0)
+			t->snaps[t->nsnaps-1].end = (nl < end) ? nl + 1 : end;
+		if ((t->nsnaps == 1) && (strncmp(p, "cpu", 3) == 0) &&
+				(p[3] >= '0') && (p[3] <= '9')) {
+			id = strtoul(p+3, NULL, 10);
+			if (id >= t->ncpus)
+				t->ncpus = id + 1;
+		}
+		if (strncmp(p, "# freqs ", 8) == 0) {
+			t->freqs = p + 8;
+		} else if (strncmp(p, "# time ", 7) == 0) {
+			if (t->nsnaps == size) {
+				size = size ? size*2 : 1024;
+				t->snaps = (snapshot_t *)realloc(t->snaps, 
+						size*sizeof(snapshot_t));
+				if (t->snaps == NULL) {
+					perror("Couldn't allocate snapshots");
+					return ENOMEM;
+				}
+			}
+			t->snaps[t->nsnaps].time = strtoull(p+7, NULL, 10);
+			t->snaps[t->nsnaps].start = p;
+			t->snaps[t->nsnaps].end = nl;
+			t->nsnaps++;
+		}
+	}
+
+	if (t->freqs == NULL || t->nsnaps < 2 || t->ncpus == 0) {
+		printf("%s: need a '# freqs' line and at least two "
+				"'# time' snapshots\n", file);
+		return EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * (Re)build the frequency tables of the simulated cpus from the trace, or
+ * from the current step if one was given.
+ */
+int sim_tables(trace_t *t)
+{
+	cpuinfo_t *cpu;
+	int i, err;
+
+	for (i = 0; i < nunits; i++) {
+		cpu = units[i];
+		if ((err = build_freq_table(cpu, t->freqs)) != 0)
+			return err;
+		if (cpu->table_size == 0) {
+			printf("Empty '# freqs' line in trace\n");
+			return EINVAL;
+		}
+		cpu->max_speed = cpu->freq_table[0];
+		cpu->min_speed = cpu->freq_table[cpu->table_size-1];
+		if (step_specified) {
+			if (step > (cpu->max_speed - cpu->min_speed))
+				step = cpu->max_speed - cpu->min_speed;
+			cpu->step = step;
+			if ((err = build_freq_table(cpu, NULL)) != 0)
+				return err;
+		}
 	}
-	
-	if ((cpu->fd = open("/proc/stat", O_RDONLY)) < 0) {
-		err = errno;
-		perror("can't open /proc/stat");
+	return 0;
+}
+
+/*
+ * Set up all_cpus to look like the cpus in the trace, and work out the
+ * load of every unit at every snapshot.  Scalable units are -c cpus wide,
+ * as there's no sysfs to look at.
+ */
+int sim_setup(trace_t *t)
+{
+	cpuinfo_t *cpu;
+	unsigned int i, j, unit;
+	unsigned char *load;
+	float pct;
+	int err;
+
+	if ((err = alloc_cpus(t->ncpus)) != 0)
 		return err;
-	}
-	
-	if ((err = get_stat(cpu)) < 0) {
-		perror("can't read /proc/stat");
+	if ((err = group_units_static(cores_specified ? t_per_core : 1)) != 0 ||
+			(err = sim_tables(t)) != 0)
 		return err;
+
+	t->load = (unsigned char *)calloc(t->nsnaps, nunits);
+	if (t->load == NULL) {
+		perror("Couldn't allocate trace load");
+		return ENOMEM;
+	}
+	for (i = 0; i < t->nsnaps; i++) {
+		parse_stat(t->snaps[i].start, t->snaps[i].end);
+		if (i == 0)
+			continue;
+		load_kernel();
+		load = t->load + (i * nunits);
+		for (unit = 0; unit < nunits; unit++) {
+			cpu = units[unit];
+			for (j = 0; j < cpu->nsiblings; j++) {
+				pct = loads[cpu->siblings[j]] * 100;
+				if (pct > load[unit])
+					load[unit] = (pct > 100) ? 100 : pct;
+			}
+		}
 	}
-	
 	return 0;
 }
 
 /*
- * Signal handler for SIGTERM/SIGINT... clean up after ourselves
+ * Run the whole trace through the current settings (func, highwater,
+ * lowwater, step, poll...).  Everything starts at full speed, like the
+ * daemon assumes it does.  Decisions are made every poll msecs, but time
+ * is accounted at every snapshot.
  */
-void terminate(int signum)
+int sim_run(trace_t *t, sim_result_t *r)
 {
-	int ncpus, i;
+	unsigned long long decided, dt;
+	unsigned int i, unit, start_poll = poll;
+	unsigned char *load;
+	unsigned int before;
 	cpuinfo_t *cpu;
-	
-	ncpus = sysconf(_SC_NPROCESSORS_CONF);
-	if (ncpus < 1) ncpus = 1;
-	
-	/* 
-	 * for each cpu, force it back to full speed.
-	 * don't mix this with the below statement.
-	 * 
-	 * 5 minutes ago I convinced myself you couldn't 
-	 * mix these two, now I can't remember why.  
-	 */
-	for(i = 0; i < ncpus; i++) {
+
+	for (i = 0; i < NSTAT; i++) {
+		memset(stat_now[i], 0, ncpus * sizeof(unsigned long long));
+		memset(stat_last[i], 0, ncpus * sizeof(unsigned long long));
+	}
+	for (i = 0; i < ncpus; i++) {
 		cpu = all_cpus[i];
-		func = LEAPS;
-		change_speed(cpu, RAISE);
+		if (cpu->hist)
+			memset(cpu->hist, 0, sizeof(history_t));
+	}
+	for (i = 0; i < nunits; i++) {
+		cpu = units[i];
+		clip_table(cpu, 0, 0);
+		cpu->speed_index = cpu->top_index;
+		cpu->current_speed = cpu->freq_table[cpu->top_index];
+		cpu->last_written = cpu->current_speed;
+		/* traces don't record transition latencies, just use -M */
+		cpu->residency_ms = min_residency;
+		cpu->changed_ms = 0;
+		cpu->budget = 0;
+		cpu->budget_ms = 0;
+		cpu->io_boost = 0;
+		/* the tuner changes the settings from run to run */
+		unit_settings(cpu);
+	}
+	if (r->tis_size < all_cpus[0]->table_size) {
+		r->tis_size = all_cpus[0]->table_size;
+		r->time_in_state = (unsigned long long *)realloc(
+				r->time_in_state,
+				r->tis_size*sizeof(unsigned long long));
+		if (r->time_in_state == NULL) {
+			perror("Couldn't allocate time in state");
+			return ENOMEM;
+		}
 	}
+	memset(r->time_in_state, 0, r->tis_size*sizeof(unsigned long long));
+	change_speed_count = 0;
+	suppressed_count = 0;
+	r->duration = 0;
+	r->underprov = 0;
+	r->energy = 0;
 
-	for(i = 0; i < ncpus; i++) {
-		cpu = all_cpus[i];
-		/* close the /proc/stat fd */
-		close(cpu->fd);
-		/* deallocate everything */
-		free(cpu->sysfs_dir);
-		free(cpu->last_reading);
-		free(cpu->reading);
-		free(cpu->freq_table);
-		free(cpu);
+	parse_stat(t->snaps[0].start, t->snaps[0].end);
+	decided = t->snaps[0].time;
+	for (i = 1; i < t->nsnaps; i++) {
+		dt = t->snaps[i].time - t->snaps[i-1].time;
+		load = t->load + (i * nunits);
+		for (unit = 0; unit < nunits; unit++) {
+			cpu = units[unit];
+			r->time_in_state[cpu->speed_index] += dt;
+			r->duration += dt;
+			r->energy += (double)dt * cpu->current_speed;
+			if ((load[unit] >= sim_highwater) && 
+					(cpu->current_speed != cpu->max_speed))
+				r->underprov += dt;
+		}
+
+		/* 
+		 * Recorded intervals jitter a bit, so allow 10% slack before
+		 * deciding a poll interval hasn't gone by yet.
+		 */
+		if (((t->snaps[i].time - decided) * 10) < (poll * 9))
+			continue;
+
+		parse_stat(t->snaps[i].start, t->snaps[i].end);
+		now_ms = t->snaps[i].time;
+		decide_all();
+		for (unit = 0; unit < nunits; unit++) {
+			cpu = units[unit];
+			before = cpu->current_speed;
+			actuate_unit(cpu, cpu->change);
+			if (cpu->current_speed != before)
+				pprintf(1, "%llu.%03llu cpu%d: %u -> %u kHz\n",
+						t->snaps[i].time / 1000,
+						t->snaps[i].time % 1000, cpu->cpuid,
+						before, cpu->current_speed);
+		}
+		if (adaptive)
+			adapt_poll();
+		decided = t->snaps[i].time;
 	}
-	free(all_cpus);
-	time_t duration = time(NULL) - start_time;
-	pprintf(1,"Statistics:\n");
-	pprintf(1,"  %d speed changes in %d seconds\n",
-			change_speed_count, (unsigned int) duration);
-	pprintf(0,"PowerNow Daemon Exiting.\n");
+	r->transitions = change_speed_count;
+	poll = start_poll;
+	return 0;
+}
 
-	closelog();
+/* energy relative to running every unit flat out the whole time */
+static inline double sim_energy(sim_result_t *r)
+{
+	return r->duration ? 
+		(r->energy / ((double)r->duration * all_cpus[0]->max_speed)) : 0;
+}
 
-	exit(0);
+static inline double sim_underprov(sim_result_t *r)
+{
+	return r->duration ? ((double)r->underprov / r->duration) : 0;
 }
 
-const char *str_func(void)
+int simulate_trace(void)
 {
-	switch (func) {
-		case SINE: return "SINE";
-		case AGGRESSIVE: return "AGGRESSIVE";
-		case PASSIVE: return "PASSIVE";
-		case LEAPS: return "LEAPS";
-		default: return "UNKNOWN";
+	trace_t t;
+	sim_result_t r;
+	cpuinfo_t *cpu;
+	enum function f, first = SINE, last = TARGET;
+	int i, err;
+	double hours;
+
+	simulate = 1;
+	sim_highwater = highwater;
+	memset(&r, 0, sizeof(r));
+	if ((err = load_trace(sim_trace, &t)) != 0 || (err = sim_setup(&t)) != 0)
+		return err;
+	cpu = all_cpus[0];
+
+	hours = (t.snaps[t.nsnaps-1].time - t.snaps[0].time) / 3600000.0;
+	printf("%s: %d cpus, %d scalable units, %u snapshots, %.2f hours\n",
+			sim_trace, ncpus, nunits, t.nsnaps, hours);
+
+	if (mode_specified)
+		first = last = func;
+	for (f = first; f <= last; f++) {
+		func = f;
+		if ((err = sim_run(&t, &r)) != 0)
+			return err;
+		printf("%-10s %8u transitions (%.1f per unit per hour), "
+				"energy %.2f%%, under-provisioned %.2f%%\n",
+				str_func(func), r.transitions, (hours > 0) ?
+				r.transitions / (hours * nunits) : 0.0,
+				100 * sim_energy(&r), 100 * sim_underprov(&r));
+		for (i = 0; i < cpu->table_size; i++) {
+			printf("    %5lu MHz: %6.2f%% %12.1f unit-secs\n",
+					cpu->freq_table[i] / 1000,
+					r.duration ? (100.0 * r.time_in_state[i] /
+						r.duration) : 0.0,
+					r.time_in_state[i] / 1000.0);
+		}
 	}
+	return 0;
 }
 
-/* Generic x86 cpuid function lifted from kernel sources */
 /*
- * Generic CPUID function
+ * Policy tuning (-T).  Searches -m, -u, -l, -p and -s over a trace, on a
+ * grid or (with -R) randomly, with one forked worker per online cpu, and
+ * prints the candidates that are Pareto optimal for estimated energy
+ * against time under-provisioned (load at or over the -u given on the
+ * command line while below max speed).
+ */
+typedef struct tune_candidate {
+	unsigned int index;
+	enum function func;
+	unsigned int highwater;
+	unsigned int lowwater;
+	unsigned int poll;
+	unsigned int step; /* 0 = the trace's own table */
+	unsigned int transitions;
+	double energy;
+	double underprov;
+} tune_t;
+
+char *tune_trace = NULL;
+unsigned int tune_random = 0;
+
+static const unsigned int tune_highwater[] = { 60, 70, 80, 90 };
+static const unsigned int tune_lowwater[] = { 10, 20, 30, 40, 50 };
+static const unsigned int tune_polls[] = { 1, 2, 5 }; /* trace intervals */
+static const unsigned int tune_steps[] = { 0, 100000, 250000 };
+
+#define ARRAY_SIZE(a) (sizeof(a)/sizeof((a)[0]))
+
+/*
+ * Evaluate every nworkers'th candidate, starting at first, and send the
+ * results up the pipe.  Runs in a child.
  */
-static inline void cpuid(int op, int *eax, int *ebx, int *ecx, int *edx)
+void tune_worker(trace_t *t, tune_t *cands, unsigned int ncands,
+		unsigned int first, unsigned int nworkers, int fd)
 {
-        __asm__("cpuid"
-                : "=a" (*eax),
-                  "=b" (*ebx),
-                  "=c" (*ecx),
-                  "=d" (*edx)
-                : "0" (op));
+	sim_result_t r;
+	unsigned int i, last_step = -1;
+
+	memset(&r, 0, sizeof(r));
+	for (i = first; i < ncands; i += nworkers) {
+		func = cands[i].func;
+		highwater = cands[i].highwater;
+		lowwater = cands[i].lowwater;
+		poll = cands[i].poll;
+		if (cands[i].step != last_step) {
+			step = last_step = cands[i].step;
+			step_specified = (step != 0);
+			if (sim_tables(t) != 0)
+				_exit(1);
+		}
+		if (sim_run(t, &r) != 0)
+			_exit(1);
+		cands[i].transitions = r.transitions;
+		cands[i].energy = sim_energy(&r);
+		cands[i].underprov = sim_underprov(&r);
+		/* well under PIPE_BUF, so the workers' writes don't mix */
+		if (write(fd, &cands[i], sizeof(tune_t)) != sizeof(tune_t))
+			_exit(1);
+	}
+	_exit(0);
 }
 
-/* 
- * A little bit of black magic to try and detect the number of cores per
- * processor.  This will have to be added on to for every architecture, 
- * as we learn how to detect them from userspace.  Note: This method
- * assumes uniform processor/thread ID's.  First look for affected_cpus, 
- * if not, then fall back to the cpuid check, or just default to 1. 
- *
- * By 'thread' in this case, I mean 'entity that is part of one scalable
- * instance'.  For example, a P4 with hyperthreading has 2 threads in 
- * one scalable instace.  So does an Athlon X2 dual core, because each
- * core has to have the same speed.  The new Yonah, on the other hand, may
- * have two scalable elements, as rumors say you can control both cores' 
- * speed individually.  Lets hope the speedstep driver populates affected_cpus
- * correctly...
- *
- * You can always override this by using the -c command line option to 
- * specify the number of threads per core.  If you do so, it will do a static
- * mapping, uniform for all real processors in the system.  Actually, so 
- * will this one, because there's no way for me to bind to a processor.
- * (yet. :)
- */
-int determine_threads_per_core(int ncpus)
+static int tune_compare(const void *a, const void *b)
 {
-	char filename[100], *p1;
-	int err, count;
+	const tune_t *a1 = (const tune_t *)a;
+	const tune_t *b1 = (const tune_t *)b;
 
-	/* if ncpus is one, we don't care */
-	if (ncpus == 1) return 1;
-	
-	/* 
-	 * First look for the affected_cpus file, and count the 
-	 * number of cpus that supports.  Assume this is true for all
-	 * cpus on the system.
-	 */
-	strncpy(filename, SYSFS_TREE, 30);
-	strncat(filename, "cpu0/cpufreq/affected_cpus", 99-strlen(filename));
-	
-	/* 
-	 * OK, the funkiest system I can think of right now is
-	 * Sun's Niagara processor, which I think would have 32
-	 * "cpus" in one scalable element.  So make this robust 
-	 * enough to at least handle more than 32 affected cpus 
-	 * at once.
-	 *
-	 * NOTE: I don't even know if Niagara supports scaling, 
-	 * I'm dealing with hypotheticals. 
-	 */
-	
-	count = 1;
-	
-	if ((err = read_file(filename, 0, 1)) == 0) {
-		p1 = buf;
-		err = strtoul(p1, &p1, 5);
-		/* 
-		 * The first cpu should always be 0, so err should be 0
-		 * after the first read.  If its anything else, default to
-		 * one, print a message, and move on. 
-		 */
-		if (err != 0) {
-			pprintf(0, "WARN: cpu0 scaling doesn't affect cpu 0?"
-				       " Assuming 1 thread per core.\n");
-			return 1;
+	if (a1->energy != b1->energy)
+		return (a1->energy < b1->energy) ? -1 : 1;
+	if (a1->underprov != b1->underprov)
+		return (a1->underprov < b1->underprov) ? -1 : 1;
+	return 0;
+}
+
+int tune(void)
+{
+	trace_t t;
+	tune_t *cands, res;
+	unsigned int ncands = 0, nworkers, interval, i, a, b, c, d, e, got = 0;
+	int pipefd[2], err, status;
+	struct timespec t0, t1;
+	double best, hours;
+	pid_t pid;
+
+	simulate = 1;
+	sim_highwater = highwater;
+	if (verbosity > 0)
+		verbosity = 0;
+	if ((err = load_trace(tune_trace, &t)) != 0 || 
+			(err = sim_setup(&t)) != 0)
+		return err;
+	hours = (t.snaps[t.nsnaps-1].time - t.snaps[0].time) / 3600000.0;
+	interval = (t.snaps[t.nsnaps-1].time - t.snaps[0].time) / 
+		(t.nsnaps - 1);
+	if (interval == 0)
+		interval = 1;
+
+	ncands = tune_random ? tune_random :
+		(NFUNCS * ARRAY_SIZE(tune_highwater) * ARRAY_SIZE(tune_lowwater) *
+		 ARRAY_SIZE(tune_polls) * ARRAY_SIZE(tune_steps));
+	cands = (tune_t *)calloc(ncands, sizeof(tune_t));
+	if (cands == NULL) {
+		perror("Couldn't allocate candidates");
+		return ENOMEM;
+	}
+
+	if (tune_random) {
+		srand(1);
+		for (i = 0; i < ncands; i++) {
+			cands[i].func = rand() % NFUNCS;
+			cands[i].highwater = 50 + (rand() % 50);
+			cands[i].lowwater = 1 + (rand() % (cands[i].highwater-1));
+			cands[i].poll = interval * (1 + (rand() % 10));
+			cands[i].step = 50000 * (rand() % 11);
+		}
+	} else {
+		/* step outermost: workers only rebuild tables as it moves */
+		ncands = 0;
+		for (e = 0; e < ARRAY_SIZE(tune_steps); e++)
+		for (a = 0; a < NFUNCS; a++)
+		for (b = 0; b < ARRAY_SIZE(tune_highwater); b++)
+		for (c = 0; c < ARRAY_SIZE(tune_lowwater); c++)
+		for (d = 0; d < ARRAY_SIZE(tune_polls); d++) {
+			if (tune_lowwater[c] >= tune_highwater[b])
+				continue;
+			/* TARGET doesn't look at lowwater */
+			if ((a == TARGET) && (c != 0))
+				continue;
+			cands[ncands].func = a;
+			cands[ncands].highwater = tune_highwater[b];
+			cands[ncands].lowwater = tune_lowwater[c];
+			cands[ncands].poll = interval * tune_polls[d];
+			cands[ncands].step = tune_steps[e];
+			ncands++;
 		}
-		while ((err = strtol(p1, &p1, 5)) != 0)
-			count ++;
-		pprintf(1, "about to return count = %d\n", count);
-		return count;	
 	}
-	pprintf(0,"err=%d", err);
-	
-#ifdef __i386__ 
-	/* Only get here if there's no affected_cpus file. */
-	/* 
-	 * XXXjc fix eventually to run on each processor so you
-	 * can support mixed multi and single-core cpus. Need to know
-	 * how to force ourselves to run on one particular processor.
-	 */
-	int eax,ebx,ecx,edx, num=1;
+	for (i = 0; i < ncands; i++)
+		cands[i].index = i;
 
-	cpuid(1,&eax,&ebx,&ecx,&edx);
+	nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers < 1)
+		nworkers = 1;
+	if (nworkers > ncands)
+		nworkers = ncands;
 
-	/* 
-	 * Do we support hyperthreading?
-	 * AMD's dual-core will masquerade as HT, so this should work 
-	 * for them too. (update: it does but this doesn't emulate
-	 * the extra ebx parameter, appearently).
-	 */
-	if(edx & 0x08000000) { 
-		/* 
-		 * if so, is it enabled? If so, how many threads 
-		 * are enabled?  Thank you, sandpile.org and the LKML. 
-		 */
-		num = (ebx & 0x00FF0000) >> 16;
+	printf("%s: %d cpus, %d scalable units, %.2f hours at %u ms\n",
+			tune_trace, ncpus, nunits, hours, interval);
+	printf("Evaluating %u candidates on %u workers...\n", ncands, 
+			nworkers);
+	fflush(stdout);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (pipe(pipefd) < 0) {
+		err = errno;
+		perror("pipe");
+		return err;
+	}
+	for (i = 0; i < nworkers; i++) {
+		if ((pid = fork()) < 0) {
+			err = errno;
+			perror("fork");
+			return err;
+		}
+		if (pid == 0) {
+			close(pipefd[0]);
+			tune_worker(&t, cands, ncands, i, nworkers, pipefd[1]);
+		}
+	}
+	close(pipefd[1]);
+	while (read(pipefd[0], &res, sizeof(tune_t)) == sizeof(tune_t)) {
+		cands[res.index] = res;
+		got++;
+	}
+	close(pipefd[0]);
+	err = 0;
+	while (wait(&status) > 0) {
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			err = EPIPE;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (err || got != ncands) {
+		printf("A tuning worker failed, %u of %u results\n", got, 
+				ncands);
+		return EPIPE;
 	}
-	/* 
-	 * if num = 0, default to 1.  Other non-multiples of cpus will
-	 * be taken care of later
-	 * XXXjc, rewrite to use sysfs (affected_cpus).
-	 */
-	return ((num)?num:1);
-#endif
-	/* always default to one thread per core */
-	return 1;
-}
 
+	printf("Done in %.2f s.\n\n", (ts_ns(&t1) - ts_ns(&t0)) / 1e9);
+	printf("Pareto front, estimated energy (100%% = all units at max "
+			"speed)\nagainst time under-provisioned (load >= %u%% "
+			"below max speed):\n\n", sim_highwater);
+	printf("  energy  underprov  trans/unit/h  settings\n");
+
+	qsort(cands, ncands, sizeof(tune_t), &tune_compare);
+	best = 2.0;
+	for (i = 0; i < ncands; i++) {
+		if (cands[i].underprov >= best)
+			continue;
+		best = cands[i].underprov;
+		printf(" %6.2f%%    %6.2f%%  %12.1f  -m %d -u %u -l %u -p %u",
+				100 * cands[i].energy, 100 * cands[i].underprov,
+				(hours > 0) ? (cands[i].transitions / 
+					(hours * nunits)) : 0.0,
+				cands[i].func, cands[i].highwater, 
+				cands[i].lowwater, cands[i].poll);
+		if (cands[i].step)
+			printf(" -s %u", cands[i].step);
+		printf("\n");
+	}
+	return 0;
+}
 
 /* 
  * Main program loop.. parse arguments, sanity chacks, setup signal handlers
@@ -757,15 +4904,16 @@ int determine_threads_per_core(int ncpus)
  */
 int main(int argc, char **argv)
 {
-	cpuinfo_t *cpu;
-	int ncpus, i, j, err, num_real_cpus, threads_per_core, cpubase;
-	enum modes change, change2;
+	struct timespec t0, t1;
+	cpuinfo_t *cpu = NULL;
+	char *p1;
+	int i, err;
 
 	/* Parse command line args */
 	while(1) {
 		int c;
 
-		c = getopt(argc, argv, "dnvqm:s:p:c:u:l:U:L:h");
+		c = getopt(argc, argv, "dnvqm:s:p:a:e:w:t:i:M:b:k:P:C:O:D:X:c:u:l:U:L:r:G:B:S:T:R:h");
 		if (c == -1)
 			break;
 
@@ -793,13 +4941,14 @@ int main(int argc, char **argv)
 				cores_specified = 1;
 				break;
 			case 'm':
+				mode_specified = 1;
 				func = strtol(optarg, NULL, 10);
-				if ((func < 0) || (func > 3)) {
+				if ((func < 0) || (func >= NFUNCS)) {
 					printf("Invalid mode specified");
 					help();
 					exit(ENOTSUP);
 				}
-				pprintf(2,"Using %s mode.\n", str_func());
+				pprintf(2,"Using %s mode.\n", str_func(func));
 				break;
 			case 's':
 				step = strtol(optarg, NULL, 10);
@@ -813,13 +4962,134 @@ int main(int argc, char **argv)
 				break;
 			case 'p':
 				poll = strtol(optarg, NULL, 10);
-				if (poll < 0) {
-					printf("poll must be non-negative");
+				if ((int)poll < 1) {
+					printf("poll must be positive");
 					help();
 					exit(ENOTSUP);
 				}
 				pprintf(2,"Polling every %d msecs\n", poll);
 				break;
+			case 'a':
+				poll_min = strtol(optarg, &p1, 10);
+				poll_max = (*p1 == ':') ? 
+					strtol(p1+1, NULL, 10) : 0;
+				if (((int)poll_min < 1) || (poll_max < poll_min)) {
+					printf("adaptive polling needs min:max "
+							"msecs, 1 <= min <= max\n");
+					help();
+					exit(ENOTSUP);
+				}
+				adaptive = 1;
+				break;
+			case 'e':
+			case 'w':
+				rise_ms = strtol(optarg, &p1, 10);
+				decay_ms = (*p1 == ':') ? 
+					strtol(p1+1, NULL, 10) : rise_ms;
+				if (((int)rise_ms < 0) || ((int)decay_ms < 0)) {
+					printf("smoothing needs rise:decay "
+							"msecs, both >= 0\n");
+					help();
+					exit(ENOTSUP);
+				}
+				smoothing = (c == 'e') ? SMOOTH_EWMA : 
+					SMOOTH_WINDOW;
+				break;
+			case 'k':
+				band = strtol(optarg, NULL, 10);
+				if ((int)band < 0) {
+					printf("band must be non-negative\n");
+					help();
+					exit(ENOTSUP);
+				}
+				coexist = 1;
+				break;
+			case 'U':
+				max_limit = strtol(optarg, NULL, 10);
+				if ((int)max_limit < 1) {
+					printf("max frequency must be positive\n");
+					help();
+					exit(ENOTSUP);
+				}
+				break;
+			case 'L':
+				min_limit = strtol(optarg, NULL, 10);
+				if ((int)min_limit < 1) {
+					printf("min frequency must be positive\n");
+					help();
+					exit(ENOTSUP);
+				}
+				break;
+			case 't':
+				if (strcmp(optarg, "exclude") == 0) {
+					steal_mode = STEAL_EXCLUDE;
+				} else if (strcmp(optarg, "idle") == 0) {
+					steal_mode = STEAL_IDLE;
+				} else if (strcmp(optarg, "busy") == 0) {
+					steal_mode = STEAL_BUSY;
+				} else {
+					printf("steal time is exclude, idle or "
+							"busy\n");
+					help();
+					exit(ENOTSUP);
+				}
+				break;
+			case 'i':
+				iowait_boost = strtol(optarg, NULL, 10);
+				if (((int)iowait_boost < 1) || 
+						(iowait_boost > 100)) {
+					printf("iowait boost needs a percentage"
+							" [1 .. 100]\n");
+					help();
+					exit(ENOTSUP);
+				}
+				break;
+			case 'M':
+				min_residency = strtol(optarg, NULL, 10);
+				if ((int)min_residency < 0) {
+					printf("residency must be non-negative\n");
+					help();
+					exit(ENOTSUP);
+				}
+				break;
+			case 'b':
+				max_rate = strtod(optarg, NULL);
+				if (max_rate <= 0) {
+					printf("transition budget must be "
+							"positive\n");
+					help();
+					exit(ENOTSUP);
+				}
+				break;
+			case 'P':
+				psi_trigger = optarg;
+				if (strncmp(psi_trigger, "some ", 5) && 
+					strncmp(psi_trigger, "full ", 5)) {
+					printf("pressure trigger must be "
+						"\"some|full <stall us> "
+						"<window us>\"\n");
+					help();
+					exit(ENOTSUP);
+				}
+				break;
+			case 'C':
+				ctl_path = optarg;
+				if (*ctl_path != '/') {
+					printf("control socket path must be "
+							"absolute\n");
+					help();
+					exit(ENOTSUP);
+				}
+				break;
+			case 'O':
+				metrics_path = optarg;
+				break;
+			case 'D':
+				trace_path = optarg;
+				break;
+			case 'X':
+				decode_path = optarg;
+				break;
 			case 'u':
 				highwater = strtol(optarg, NULL, 10);
 				if ((highwater < 0) || (highwater > 100)) {
@@ -838,6 +5108,44 @@ int main(int argc, char **argv)
 				}
 				pprintf(2,"Using lower pct of %d%%\n",lowwater);
 				break;
+			case 'r':
+				root_dir = optarg;
+				if ((strlen(root_dir) + strlen(SYSFS_TREE)) >= 
+						ROOT_MAX) {
+					printf("root directory name too long\n");
+					exit(ENAMETOOLONG);
+				}
+				break;
+			case 'B':
+				bench_ticks = strtol(optarg, NULL, 10);
+				if (bench_ticks < 1) {
+					printf("need at least one tick to bench\n");
+					help();
+					exit(ENOTSUP);
+				}
+				daemonize = 0;
+				break;
+			case 'S':
+				sim_trace = optarg;
+				daemonize = 0;
+				break;
+			case 'T':
+				tune_trace = optarg;
+				daemonize = 0;
+				break;
+			case 'R':
+				tune_random = strtol(optarg, NULL, 10);
+				break;
+			case 'G':
+				fake_cpus = strtol(optarg, &p1, 10);
+				if (*p1 == 'm')
+					fake_unit = 1000;
+				if (fake_cpus < 1) {
+					printf("need at least one fake cpu\n");
+					help();
+					exit(ENOTSUP);
+				}
+				break;
 			case 'h':
 			default:
 				help();
@@ -851,6 +5159,61 @@ int main(int argc, char **argv)
 		help();
 		exit(ENOTSUP);
 	}
+
+	if ((clk_tck = sysconf(_SC_CLK_TCK)) <= 0)
+		clk_tck = 100;
+
+	if (max_limit && (min_limit > max_limit)) {
+		printf("Invalid: min frequency higher than max frequency!\n");
+		help();
+		exit(ENOTSUP);
+	}
+
+	/* start at -p, but inside the adaptive range */
+	if (adaptive) {
+		if (poll < poll_min)
+			poll = poll_min;
+		if (poll > poll_max)
+			poll = poll_max;
+	}
+
+	if (!window_fits(adaptive ? poll_min : poll)) {
+		printf("-w windows can be at most %d polls, %u msecs at %u "
+				"msec polls\n", HIST_LEN, 
+				HIST_LEN * (adaptive ? poll_min : poll),
+				adaptive ? poll_min : poll);
+		help();
+		exit(ENOTSUP);
+	}
+
+	if (root_dir) {
+		snprintf(sysfs_tree, sizeof(sysfs_tree), "%s%s", root_dir,
+				SYSFS_TREE);
+		snprintf(proc_stat, sizeof(proc_stat), "%s%s", root_dir,
+				PROC_STAT);
+		snprintf(proc_pressure, sizeof(proc_pressure), "%s%s", 
+				root_dir, PROC_PRESSURE);
+	}
+
+	if (fake_cpus) {
+		if (root_dir == NULL) {
+			printf("-G needs a root directory to build in (-r)\n");
+			exit(ENOTSUP);
+		}
+		return make_fake_tree();
+	}
+
+	if (decode_path)
+		return decode_trace();
+	if (sim_trace)
+		return simulate_trace();
+	if (tune_trace)
+		return tune();
+
+	if (bench_ticks && (root_dir == NULL)) {
+		printf("-B rewrites /proc/stat, it needs a fake root (-r)\n");
+		exit(ENOTSUP);
+	}
 	
 	/* so we don't interfere with anything, including ourself */
 	nice(5);
@@ -862,125 +5225,148 @@ int main(int argc, char **argv)
 	pprintf(0,"PowerNow Daemon v%s, (c) 2003-2008 John Clemens\n", 
 			VERSION);
 
-	/* are we root?? */
-	if (getuid() != 0) {
+	/* are we root?? (nobody cares under a fake root) */
+	if ((root_dir == NULL) && (getuid() != 0)) {
 		printf("Go away, you are not root. Only root can run me.\n");
 		exit(EPERM);
 	}
 
 	pprintf(1,"Settings:\n");
 	pprintf(1,"  verbosity:     %4d\n", verbosity);
-	pprintf(1,"  mode:          %4d     (%s)\n", func, str_func());
+	pprintf(1,"  mode:          %4d     (%s)\n", func, str_func(func));
 	pprintf(1,"  step:          %4d MHz (%d kHz)\n", step/1000, step);
 	pprintf(1,"  lowwater:      %4d %%\n", lowwater);
 	pprintf(1,"  highwater:     %4d %%\n", highwater);
 	pprintf(1,"  poll interval: %4d ms\n", poll);
+	if (adaptive)
+		pprintf(1,"  adaptive:      %4d - %d ms\n", poll_min, poll_max);
+	if (psi_trigger)
+		pprintf(1,"  pressure:      %s\n", psi_trigger);
+	if (ctl_path)
+		pprintf(1,"  control:       %s\n", ctl_path);
+	if (metrics_path)
+		pprintf(1,"  metrics:       %s\n", metrics_path);
+	if (trace_path)
+		pprintf(1,"  trace:         %s\n", trace_path);
+	if (coexist)
+		pprintf(1,"  governor band: %4d steps each side\n", band);
+	if (max_limit)
+		pprintf(1,"  max speed:     %4d MHz\n", max_limit / 1000);
+	if (min_limit)
+		pprintf(1,"  min speed:     %4d MHz\n", min_limit / 1000);
+	if (min_residency)
+		pprintf(1,"  min residency: %4d ms\n", min_residency);
+	if (max_rate > 0)
+		pprintf(1,"  max rate:      %6.1f transitions/sec/unit\n", 
+				max_rate);
+	if (smoothing != SMOOTH_NONE)
+		pprintf(1,"  %s:   %4d ms rise, %d ms decay\n", 
+				(smoothing == SMOOTH_EWMA) ? "ewma load  " : 
+				"load window", rise_ms, decay_ms);
+	if (steal_mode != STEAL_EXCLUDE)
+		pprintf(1,"  steal time:    %s\n", 
+				(steal_mode == STEAL_BUSY) ? "busy" : "idle");
+	if (iowait_boost)
+		pprintf(1,"  iowait boost:  %4d %% iowait\n", iowait_boost);
 
 	/* 
 	 * This should tell us the number of CPUs that Linux thinks we have,
 	 * or, at least GLIBC
 	 */	
-	ncpus = sysconf(_SC_NPROCESSORS_CONF);
+	ncpus = count_cpus();
 	if (ncpus < 0) {
 		perror("sysconf could not determine number of cpus, assuming 1\n");
 		ncpus = 1;
 	}
 	
-	if (cores_specified) {
-		if (ncpus < t_per_core) {
-			printf("\nWARNING: bogus # of thread per core, assuming 1\n");
-			threads_per_core = 1;
-		} else {
-			threads_per_core = t_per_core;
-		}
-	} else { 
-		threads_per_core = determine_threads_per_core(ncpus);
-		if (threads_per_core < 0) 
-			threads_per_core = 1;
-	}
-	
-	/* We don't support mixed configs yet */
-	if (!ncpus || !threads_per_core || ncpus % threads_per_core) {	
-		printf("WARN: ncpus(%d) is not a multiple of threads_per_core(%d)!\n",
-			ncpus, threads_per_core);
-		printf("WARN: Assuming 1.\n");
-		threads_per_core = 1;
-		/*help();
-		exit(ENOTSUP);*/
+	if (cores_specified && (ncpus < t_per_core)) {
+		printf("\nWARNING: bogus # of thread per core, assuming 1\n");
+		t_per_core = 1;
 	}
-	
-	num_real_cpus = ncpus/threads_per_core;
 
 	/* Malloc, initialise data structs */
-	all_cpus = (cpuinfo_t **) malloc(sizeof(cpuinfo_t *)*ncpus);
-	if (all_cpus == (cpuinfo_t **)NULL) {
-		perror("Couldn't malloc all_cpus");
+	if ((err = alloc_cpus(ncpus)) != 0)
+		return err;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	/* which cpus are online now, if we can tell */
+	now_online = (char *)malloc(ncpus);
+	online_list = (int *)malloc(ncpus*sizeof(int));
+	if ((now_online == NULL) || (online_list == NULL)) {
+		perror("Couldn't malloc online mask");
 		return ENOMEM;
 	}
-	
-	for (i=0; i<ncpus; i++) {
-		all_cpus[i] = (cpuinfo_t *)malloc(sizeof(cpuinfo_t));
-		if (all_cpus[i] == (cpuinfo_t *)NULL) {
-			perror("Couldn't malloc all_cpus");
-			return ENOMEM;
-		}
-		memset(all_cpus[i],0,sizeof(cpuinfo_t));
-	}
-	
-	for (i=0;i<ncpus;i++) {
-		all_cpus[i]->threads_per_core = threads_per_core;
-		all_cpus[i]->scalable_unit = (i/threads_per_core)*threads_per_core;
+	update_online();
+
+	if ((err = discover_units()) != 0 || (nunits == 0)) {
+		printf("No cpufreq policies found\n");
+		err = err ? err : ENOENT;
+		goto out;
 	}
 	
-	pprintf(0,"Found %d scalable unit%s:  -- %d 'CPU%s' per scalable unit\n",
-			num_real_cpus,
-			(num_real_cpus>1)?"s":"",
-			threads_per_core,
-			(threads_per_core>1)?"s":"");
+	pprintf(0,"Found %d scalable unit%s:\n", nunits, (nunits>1)?"s":"");
 	
-	for (i=0;i<ncpus;i++) {
-		cpu = all_cpus[i];
-		if ((err = get_per_cpu_info(cpu, i)) != 0) {
+	for (i=0;i<nunits;i++) {
+		cpu = units[i];
+		/* we'll look at it when it comes online */
+		if (unit_is_offline(cpu)) {
+			cpu->unit_offline = cpu->needs_init = 1;
+			continue;
+		}
+		if ((err = get_per_cpu_info(cpu)) != 0) {
 			printf("\n");
 			goto out;
 		}
-		pprintf(0,"  cpu%d: %dMhz - %dMhz (%d steps)\n", 
-				cpu->cpuid,
-				cpu->min_speed / 1000, 
-				cpu->max_speed / 1000, 
-				cpu->table_size);
-		for(j=0;j<cpu->table_size; j++) {
-			pprintf(1, "     step%d : %ldMhz\n", j+1, 
-					cpu->freq_table[j] / 1000);
+	}
+	if ((err = check_governors()) != 0) {
+		printf("\n");
+		goto out;
+	}
+	for (i=0;i<nunits;i++) {
+		cpu = units[i];
+		if (cpu->unit_offline) {
+			pprintf(0,"  cpu%d: offline\n", cpu->cpuid);
+			continue;
+		}
+		if ((err = settle_unit(cpu)) != 0) {
+			printf("\n");
+			goto out;
 		}
+		show_unit(cpu);
 	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	pprintf(0,"Started %d scalable unit%s in %.1f ms\n", nunits, 
+			(nunits>1)?"s":"", (ts_ns(&t1) - ts_ns(&t0)) / 1e6);
 	
-	/* now that everything's all set up, lets set up a exit handler */
-	signal(SIGTERM, terminate);
-	signal(SIGINT, terminate);
-	
+	/* take the first snapshot so the first poll has something to diff */
+	if ((stat_fd = open(proc_stat, O_RDONLY)) < 0) {
+		err = errno;
+		perror(proc_stat);
+		goto out;
+	}
+	if ((err = get_stat()) != 0) {
+		perror("can't read /proc/stat");
+		goto out;
+	}
+
+	if (trace_path && ((err = setup_trace()) != 0))
+		goto out;
+
+	if (bench_ticks)
+		return bench();
+
 	if (daemonize)
 		daemon(0, 0);
 
+	/* now that everything's all set up, set up the timer and signals */
+	if ((err = setup_events()) != 0)
+		goto out;
+
 	start_time = time(NULL);
 
 	/* Now the main program loop */
-	while(1) {
-		usleep(poll*1000);
-		for(i=0; i<num_real_cpus; i++) {
-			change = LOWER;
-			cpubase = i*threads_per_core;
-			pprintf(6, "i = %d, cpubase = %d, ",i,cpubase);
-			/* handle SMT/CMP here */
-			for (j=0; j<all_cpus[cpubase]->threads_per_core; j++) {
-				change2 = decide_speed(all_cpus[cpubase+j]);
-				pprintf(6, "change = %d, change2 = %d\n",change,change2);
-				if (change2 > change)
-					change = change2;
-			}
-			if (change != SAME) change_speed(all_cpus[cpubase], change);
-		}
-	}
+	event_loop();
 
 out:
 	printf("PowerNowd encountered and error and could not start.\n");
@@ -997,7 +5383,6 @@ out:
 	
 	/* should free more here.. will get to that later.... */
 	/* or we can just be lazy and let the OS do it for us... */
-	free(cpu);
 	return err;
 }
 